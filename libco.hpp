@@ -1,34 +1,317 @@
 #pragma once
 #include <cassert>
 #include <stdexcept>
+#include <string>
+#include <vector>
+#include <algorithm>
 #include <functional>
 #include <unordered_map>
+#include <atomic>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+#include <arm_neon.h>
+#endif
+// winbase.h still defines the win16 Yield() as nothing
+#ifdef Yield
+#undef Yield
+#endif
 
 namespace libco
 {
 	class ITask;
 	class IScheduler;
+	class TaskHandle;
 	typedef std::function<void(ITask*)> Routine;
+	namespace impl
+	{
+		class IXTask;
+
+		// index of the highest set bit, mask must not be 0
+		inline unsigned int HighestBit(std::uint64_t mask)
+		{
+#if defined(_MSC_VER)
+			unsigned long index;
+#if defined(_M_X64) || defined(_M_ARM64)
+			_BitScanReverse64(&index, mask);
+#else
+			if (_BitScanReverse(&index, (unsigned long)(mask >> 32)))
+			{
+				index += 32;
+			}
+			else
+			{
+				_BitScanReverse(&index, (unsigned long)mask);
+			}
+#endif
+			return index;
+#else
+			return 63 - __builtin_clzll(mask);
+#endif
+		}
+	}
+
+	// run queue classes, see IScheduler::NewTask
+	enum Priority
+	{
+		priority_interactive, // health checks, small rpcs
+		priority_normal,
+		priority_background,  // bulk transfers, batch jobs
+		priority_classes
+	};
+
+	// loop timing, see IScheduler::LoopTiming
+	enum LoopMetric
+	{
+		loop_iteration, // work of one loop iteration, waiting for io left out
+		loop_wakeup,    // io or timer callback to its task running
+		loop_slice,     // task resumed to suspended again
+		loop_metrics
+	};
+
+	// what a suspended task waits for, see SchedulerStats::blocked
+	enum BlockReason
+	{
+		blocked_io,    // sockets, files, dns, send backpressure
+		blocked_timer, // Sleep
+		blocked_sync,  // locks, channels, pooled connections
+		blocked_join,  // join, WhenAny, task groups
+		blocked_pool,  // run_blocking, waiting for or running on a worker
+		block_reasons
+	};
+
+	// log-linear buckets as in HdrHistogram, 16 per power of two so a value is
+	// kept within 1/16. recording is an index and an increment, no allocation
+	class Histogram
+	{
+	public:
+		enum { sub_bits = 4, sub_count = 1 << sub_bits, bucket_count = (64 - sub_bits + 1) * sub_count };
+	public:
+		Histogram() { reset(); }
+	public:
+		void record(std::uint64_t value)
+		{
+			m_buckets[Index(value)]++;
+			m_count++;
+			m_sum += value;
+			if (value > m_max)
+			{
+				m_max = value;
+			}
+		}
+		void reset()
+		{
+			memset(m_buckets, 0x00, sizeof(m_buckets));
+			m_count = 0;
+			m_sum = 0;
+			m_max = 0;
+		}
+		std::uint64_t count() const { return m_count; }
+		std::uint64_t max() const { return m_max; }
+		double mean() const { return (m_count > 0) ? (double)m_sum / m_count : 0.0; }
+		// upper bound of the bucket holding the given percentile (0 - 100)
+		std::uint64_t percentile(double p) const
+		{
+			std::uint64_t rank = (std::uint64_t)(m_count * p / 100.0 + 0.5);
+			std::uint64_t seen = 0;
+
+			rank = (rank < 1) ? 1 : rank;
+			for (int i = 0; i < bucket_count; i++)
+			{
+				if ((seen += m_buckets[i]) >= rank)
+				{
+					return (std::min)(Upper(i), m_max);
+				}
+			}
+			return m_max;
+		}
+	protected:
+		static int Index(std::uint64_t value)
+		{
+			if (value < sub_count)
+			{
+				return (int)value;
+			}
+			unsigned int bit = impl::HighestBit(value);
+			unsigned int shift = bit - sub_bits;
+
+			return (int)((shift + 1) * sub_count + ((value >> shift) - sub_count));
+		}
+		static std::uint64_t Upper(int index)
+		{
+			if (index < sub_count)
+			{
+				return index;
+			}
+			unsigned int shift = index / sub_count - 1;
+			std::uint64_t lower = (std::uint64_t)(sub_count + index % sub_count) << shift;
+
+			return lower + ((std::uint64_t)1 << shift) - 1;
+		}
+	private:
+		std::uint64_t m_buckets[bucket_count];
+		std::uint64_t m_count;
+		std::uint64_t m_sum;
+		std::uint64_t m_max;
+	};
 
 	enum { invalid_socket = -1 };
 
+	// one entry of ITask::read_batch
+	struct FileRead
+	{
+		uv_file file;
+		char* buf;
+		unsigned int len;
+		std::int64_t offset;
+		ssize_t result; // bytes read or uv error code
+	};
+
+	// zero means keep the kernel default
+	struct SocketOptions
+	{
+		int nodelay;      // TCP_NODELAY, negative turns it off again
+		int keepalive;    // keep-alive delay in seconds, negative turns it off
+		int sndbuf;       // SO_SNDBUF
+		int rcvbuf;       // SO_RCVBUF
+		int defer_accept; // TCP_DEFER_ACCEPT seconds, listener only
+		int fastopen;     // TCP_FASTOPEN queue length, listener only
+		int write_high;   // queued bytes before send suspends, 0 keeps send unbuffered
+		int write_low;    // send resumes below it, 0 is half of write_high
+		int max_connections; // accept waits while this many accepted sockets are open, listener only
+	};
+
+	// what the watchdog saw, see IScheduler::SetWatchdog
+	struct HogReport
+	{
+		enum { max_frames = 32 };
+		ITask* task;              // only to tell tasks apart, it may be gone by now
+		std::uint64_t running_ms; // since the task was resumed
+		int frames;               // 0 where the stack can not be walked
+		void* stack[max_frames];  // return addresses, innermost first
+	};
+
+	// see IScheduler::GetStats, counters only grow except tasks_live, tasks_ready, blocked and sockets
+	struct SchedulerStats
+	{
+		std::uint64_t tasks_created;
+		std::uint64_t tasks_finished;
+		std::uint64_t tasks_live;
+		std::uint64_t tasks_ready;    // in the ready queues
+		std::uint64_t switches;       // tasks resumed
+		std::uint64_t wakeups_ready;  // resumed from the ready queue: start, Yield, locks, channels, join
+		std::uint64_t wakeups_remote; // woken from another thread, part of wakeups_ready
+		std::uint64_t wakeups_timer;  // Sleep and timeouts
+		std::uint64_t wakeups_io;     // sockets, files and the threadpool
+		std::uint64_t blocked[block_reasons]; // tasks suspended now, by what they wait for
+		std::uint64_t sockets;        // tcp sockets open
+		std::uint64_t bytes_in;
+		std::uint64_t bytes_out;
+	};
+
+	struct TaskStats
+	{
+		std::uint64_t switches; // times resumed
+		std::uint64_t run_ns;   // time between being resumed and suspending again
+	};
+
 	class ITask
 	{
 	public:
 		virtual IScheduler* GetOwner() = 0;
 	public: // basic
 		virtual bool Sleep(std::uint64_t ms) = 0;
+		// set by TaskHandle::cancel, recv / send return UV_ECANCELED and Sleep false from then on
+		virtual bool IsCancelled() = 0;
+		// runs again after the tasks that are ready now and one poll for io
+		virtual void Yield() = 0;
+		// yields when the task ran longer than its time slice since it was resumed,
+		// cheap enough to call in every round of a long loop
+		virtual bool MaybeYield() = 0;
+		// in microseconds, 0 turns MaybeYield off
+		virtual void SetTimeSlice(std::uint64_t us) = 0;
+		// from any thread while the task is alive
+		virtual void GetStats(TaskStats& stats) = 0;
 	public: // socket
 		virtual uv_os_sock_t socket(int af, int type = SOCK_STREAM, int protocol = IPPROTO_TCP) = 0;
 		virtual int closesocket(uv_os_sock_t s) = 0;
 		virtual int connect(uv_os_sock_t s, const struct sockaddr* name, int namelen) = 0;
 		virtual int send(uv_os_sock_t s, const char* buf, int len) = 0;
+		// all buffers in order, one write for the whole list
+		virtual int send(uv_os_sock_t s, const uv_buf_t bufs[], unsigned int nbufs) = 0;
 		virtual int recv(uv_os_sock_t s, char* buf, int len) = 0;
 		virtual int shutdown(uv_os_sock_t s) = 0;
 		virtual int bind(uv_os_sock_t s, const struct sockaddr* addr, int namelen) = 0;
 		virtual int listen(uv_os_sock_t s, int backlog) = 0;
 		virtual uv_os_sock_t accept(uv_os_sock_t s, struct sockaddr* addr, int* addrlen) = 0;
+		virtual int resolve(const char* host, int port, struct sockaddr* addr, int* addrlen, int af = AF_UNSPEC) = 0;
+		// set on a listener, options become the defaults of every accepted socket
+		virtual int setsockopt(uv_os_sock_t s, const SocketOptions& options) = 0;
+	public: // readiness of sockets owned by other libraries, timeout in ms (-1 forever)
+		// returns uv_poll_event mask, 0 on timeout or uv error code
+		virtual int wait_readable(uv_os_sock_t s, std::int64_t timeout = -1) = 0;
+		virtual int wait_writable(uv_os_sock_t s, std::int64_t timeout = -1) = 0;
+		// call before the library closes the socket
+		virtual int wait_release(uv_os_sock_t s) = 0;
+	public: // connection pool, keep-alive sockets per destination
+		virtual uv_os_sock_t pool_connect(const struct sockaddr* name, int namelen) = 0;
+		virtual int pool_release(uv_os_sock_t s, bool reuse = true) = 0;
+	public: // proxy
+		// moves bytes both ways until both peers finished sending, eof of one
+		// side is passed on as shutdown of the other. sockets stay open
+		virtual int relay(uv_os_sock_t a, uv_os_sock_t b) = 0;
+	public: // file, run on libuv threadpool
+		virtual uv_file open(const char* path, int flags, int mode = 0) = 0;
+		virtual int close(uv_file file) = 0;
+		virtual ssize_t read(uv_file file, char* buf, unsigned int len) = 0;
+		virtual ssize_t write(uv_file file, const char* buf, unsigned int len) = 0;
+		virtual ssize_t pread(uv_file file, char* buf, unsigned int len, std::int64_t offset) = 0;
+		virtual ssize_t pwrite(uv_file file, const char* buf, unsigned int len, std::int64_t offset) = 0;
+		virtual int fsync(uv_file file) = 0;
+		virtual int stat(const char* path, uv_stat_t* statbuf) = 0;
+		// all reads share one threadpool hop, every FileRead::result is filled
+		virtual int read_batch(FileRead* reads, int count) = 0;
+	public: // cpu bound work, run on libuv threadpool
+		// only this task waits for it. 0, or UV_ECANCELED when the task was cancelled
+		// before a thread picked the routine up. routine must not throw
+		virtual int run_blocking(std::function<void()> routine) = 0;
+	};
+
+	// what NewTask returns, a finished task is kept for its handles. handles
+	// belong to the scheduler thread and must be gone before the scheduler
+	class TaskHandle
+	{
+	public:
+		TaskHandle() : m_task(nullptr) { }
+		explicit TaskHandle(impl::IXTask* task);
+		TaskHandle(const TaskHandle& other);
+		TaskHandle(TaskHandle&& other) : m_task(other.m_task) { other.m_task = nullptr; }
+		TaskHandle& operator=(TaskHandle other) { std::swap(m_task, other.m_task); return *this; }
+		~TaskHandle();
+	public:
+		explicit operator bool() const { return (m_task != nullptr); }
+		ITask* get() const;
+		bool done() const;
+		// suspends the calling task until this one returned, 0 or UV_ECANCELED
+		// when it was cancelled, tasks of the same scheduler only
+		int join(ITask* task);
+		// cooperative, a recv / send / Sleep the task is blocked in returns at once.
+		// bytes of a blocked send can not be taken back, its socket stays open
+		// but later sends on it fail with UV_ECANCELED, the owner still closes it
+		void cancel();
+	private:
+		friend int WhenAny(ITask* task, TaskHandle* handles, int count);
+		impl::IXTask* m_task;
 	};
+	// 0 once all returned, UV_ECANCELED when one of them was cancelled
+	int WhenAll(ITask* task, TaskHandle* handles, int count);
+	// index of a task that returned, -1 without valid handles
+	int WhenAny(ITask* task, TaskHandle* handles, int count);
 
 	class IScheduler
 	{
@@ -36,7 +319,44 @@ namespace libco
 		virtual void Delete() = 0;
 	public:
 		virtual bool Peek() = 0;
-		virtual bool NewTask(Routine routine) = 0;
+		// ready tasks of a higher class run first, a lower class still gets its
+		// weight every loop iteration so it can not starve
+		virtual TaskHandle NewTask(Routine routine, Priority priority = priority_normal) = 0;
+		// ns between a task becoming ready and running, per class
+		virtual const Histogram& ReadyLatency(Priority priority) = 0;
+	public: // loop timing in ns, read and reset them on the scheduler thread
+		virtual const Histogram& LoopTiming(LoopMetric metric) = 0;
+		// loop timing and ready latency start over
+		virtual void ResetTiming() = 0;
+		// one line per histogram: count, mean, percentiles and max in microseconds
+		virtual std::string DumpTiming() = 0;
+	public: // connection pool
+		virtual void SetPoolLimit(int max_per_host) = 0;
+	public: // write queue of sockets with SocketOptions::write_high
+		// limit over all sockets of the scheduler, 0 is unlimited
+		virtual void SetWriteLimit(std::size_t high, std::size_t low) = 0;
+		// bytes sent but not yet written to the kernel, invalid_socket for the whole scheduler
+		virtual std::size_t QueuedBytes(uv_os_sock_t s = (uv_os_sock_t)invalid_socket) = 0;
+	public: // overload protection, accept stops taking connections from the backlog, 0 disables a limit
+		// accept waits while the scheduler runs this many tasks
+		virtual void SetTaskLimit(int max_tasks) = 0;
+		// accept pauses while the loop lags or the process uses more memory,
+		// it goes on once the lag is below half and the memory below 90%
+		virtual void SetOverloadLimit(std::uint64_t max_lag_ms, std::size_t max_rss) = 0;
+		virtual bool IsOverloaded() = 0;
+	public: // ITask::run_blocking
+		// calls on the threadpool at once, later ones wait in order, 0 is unlimited.
+		// the default leaves half of the threadpool to file io
+		virtual void SetBlockingLimit(int max_running) = 0;
+	public: // watchdog
+		// a thread checks whether a task runs longer than threshold_ms without
+		// giving the loop back, and calls handler once per such run on that thread,
+		// while the task goes on. with preempt the next MaybeYield of the task yields.
+		// call it on the scheduler thread, 0 stops the watchdog
+		virtual int SetWatchdog(std::uint64_t threshold_ms, bool preempt, std::function<void(const HogReport&)> handler) = 0;
+	public: // statistics
+		// from any thread, each counter is read on its own so they may be off by a few
+		virtual void GetStats(SchedulerStats& stats) = 0;
 	};
 
 	namespace impl
@@ -58,6 +378,115 @@ namespace libco
 			return ptr;
 		}
 
+		// ws2_32 itself. libco is compiled into the module InstallHooks patches,
+		// its own calls must not go through the redirected import table
+		struct winsock_raw
+		{
+			SOCKET(WSAAPI* socket)(int af, int type, int protocol);
+			int (WSAAPI* closesocket)(SOCKET s);
+			int (WSAAPI* recv)(SOCKET s, char* buf, int len, int flags);
+		};
+		inline const winsock_raw& RawWinsock()
+		{
+			static const winsock_raw raw = []() {
+				winsock_raw r;
+				HMODULE ws2 = GetModuleHandleA("ws2_32.dll");
+
+				assert(ws2 != nullptr);
+				r.socket = (decltype(r.socket))GetProcAddress(ws2, "socket");
+				r.closesocket = (decltype(r.closesocket))GetProcAddress(ws2, "closesocket");
+				r.recv = (decltype(r.recv))GetProcAddress(ws2, "recv");
+				return r;
+			}();
+			return raw;
+		}
+
+		// task running on this thread, nullptr on a scheduler
+		inline IXTask*& CurrentTask()
+		{
+			static thread_local IXTask* current = nullptr;
+			return current;
+		}
+
+		// shared by a scheduler and its watchdog thread, the tasks write it
+		struct watch_state
+		{
+			bool armed; // scheduler thread only
+			std::atomic<IXTask*> task;
+			std::atomic<std::uint64_t> since; // ns the task was resumed, 0 while the loop runs
+			std::atomic<bool> preempt;        // set by the watchdog, taken by MaybeYield
+		};
+
+		// loop timing shared by the scheduler and its tasks, scheduler thread only
+		struct loop_state
+		{
+			bool polling;              // from prepare to the first callback of the poll
+			std::uint64_t prepared;    // the poll was entered
+			std::uint64_t batch_start; // the loop came back from waiting for io
+			std::uint64_t checked;     // end of the previous iteration
+			Histogram timing[loop_metrics];
+		};
+
+		// written by the scheduler thread only, a load and a store is enough and
+		// costs no locked instruction. any thread may read it
+		struct stat_counter
+		{
+			std::atomic<std::uint64_t> value;
+
+			void add(std::uint64_t n = 1) { value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+			void sub(std::uint64_t n = 1) { value.store(value.load(std::memory_order_relaxed) - n, std::memory_order_relaxed); }
+			std::uint64_t get() const { return value.load(std::memory_order_relaxed); }
+		};
+		// differences of two counters give what is live
+		struct scheduler_counters
+		{
+			stat_counter tasks_created;
+			stat_counter tasks_finished;
+			stat_counter ready_queued;
+			stat_counter switches;
+			stat_counter wakeups_ready;
+			stat_counter wakeups_remote;
+			stat_counter wakeups_timer;
+			stat_counter blocked[block_reasons]; // up on suspend, down on resume
+			stat_counter sockets_opened;
+			stat_counter sockets_closed;
+			stat_counter bytes_in;
+			stat_counter bytes_out;
+		};
+
+		// task local slots, the index is the same in every task
+		enum { max_task_locals = 16 };
+		struct local_slot
+		{
+			void (*destroy)(void* value);
+			void* (*copy)(const void* value); // nullptr when children do not inherit it
+		};
+		inline local_slot* LocalSlots()
+		{
+			static local_slot slots[max_task_locals];
+			return slots;
+		}
+		inline int LocalSlotCount(int add = 0)
+		{
+			static std::atomic<int> count(0);
+			return (count += add) - add;
+		}
+		inline int AllocLocalSlot(void (*destroy)(void*), void* (*copy)(const void*))
+		{
+			int index = LocalSlotCount(1);
+
+			if (index >= max_task_locals)
+			{
+				throw std::runtime_error("Too many task locals");
+			}
+			LocalSlots()[index] = { destroy, copy };
+			return index;
+		}
+
+		// what the exclude slot of a socket handle holds, tagged by its first field
+		enum uv_exclude_type { uv_exclude_none, uv_exclude_recv, uv_exclude_listen, uv_exclude_relay, uv_exclude_select };
+		struct uv_exclude_ext { uv_exclude_type type; };
+
 		class CXHandle
 		{
 		public:
@@ -94,7 +523,7 @@ namespace libco
 
 				m_handle = (uv_handle_t*)any_handle;
 			}
-			CXHandle(uv_loop_t* loop, uv_handle_type type)
+			CXHandle(uv_loop_t* loop, uv_handle_type type, uv_os_sock_t sock = (uv_os_sock_t)invalid_socket)
 			{
 				int errcode = -1;
 				assert(loop != nullptr);
@@ -111,6 +540,18 @@ namespace libco
 				case UV_TCP:
 					errcode = uv_tcp_init(loop, *this);
 					break;
+				case UV_POLL:
+					errcode = uv_poll_init_socket(loop, *this, sock);
+					break;
+				case UV_IDLE:
+					errcode = uv_idle_init(loop, *this);
+					break;
+				case UV_PREPARE:
+					errcode = uv_prepare_init(loop, *this);
+					break;
+				case UV_CHECK:
+					errcode = uv_check_init(loop, *this);
+					break;
 				default:
 					throw std::invalid_argument("Unsupported uv handle type");
 					break;
@@ -121,7 +562,36 @@ namespace libco
 					throw std::runtime_error("Init uv handle error");
 				}
 			}
+			// async handles need their callback at init
+			CXHandle(uv_loop_t* loop, uv_async_cb async_cb)
+			{
+				assert(loop != nullptr);
+				assert(async_cb != nullptr);
+
+				m_handle = AllocHandle(UV_ASYNC);
+				if (uv_async_init(loop, *this, async_cb) != 0)
+				{
+					FreeHandle(m_handle);
+					throw std::runtime_error("Init uv handle error");
+				}
+			}
 			virtual ~CXHandle() { }
+			// a poll handle without the throw, 0 or the error of uv_poll_init_socket
+			static int OpenPoll(uv_loop_t* loop, uv_os_sock_t sock, CXHandle& Handle)
+			{
+				uv_handle_t* handle = AllocHandle(UV_POLL);
+				int errcode = uv_poll_init_socket(loop, (uv_poll_t*)handle, sock);
+
+				if (errcode != 0)
+				{
+					// never initialized, nothing to close
+					MemFree(handle->data);
+					MemFree(handle);
+					return errcode;
+				}
+				Handle.m_handle = handle;
+				return 0;
+			}
 		public:
 			operator uv_handle_t*() const { return m_handle; }
 			template<typename _Tn> operator _Tn*() const
@@ -192,11 +662,11 @@ namespace libco
 				assert(ctx->owner == nullptr);
 				ctx->owner = task;
 			}
-		public: // only for socket handle
+		public: // only for socket and poll handle
 			template<class _Tn>
 			_Tn* GetExclude()
 			{
-				assert(m_handle->type == UV_TCP);
+				assert((m_handle->type == UV_TCP) || (m_handle->type == UV_POLL));
 
 				auto* ctx = GetHandleContext();
 
@@ -205,7 +675,7 @@ namespace libco
 			}
 			bool SetExclude(void* object)
 			{
-				assert(m_handle->type == UV_TCP);
+				assert((m_handle->type == UV_TCP) || (m_handle->type == UV_POLL));
 
 				bool ok;
 				auto* ctx = GetHandleContext();
@@ -219,7 +689,7 @@ namespace libco
 			}
 			void ResetExclude()
 			{
-				assert(m_handle->type == UV_TCP);
+				assert((m_handle->type == UV_TCP) || (m_handle->type == UV_POLL));
 
 				auto* ctx = GetHandleContext();
 
@@ -229,6 +699,14 @@ namespace libco
 			uv_handle_t* m_handle;
 		};
 
+		// one task waiting in join / WhenAny, fired makes sure it is woken once
+		struct join_waiter
+		{
+			IXTask* task;
+			join_waiter* next;
+			bool* fired;
+		};
+
 		class IXTask : public ITask
 		{
 		public:
@@ -236,27 +714,102 @@ namespace libco
 		public:
 			virtual FIBER_T GetFiber() const = 0;
 			virtual IXScheduler* GetXOwner() const = 0;
+		public: // only from the scheduler side / only from the task itself
+			// now saves a clock read when the caller has just taken it
+			virtual void Resume(std::uint64_t now = 0) = 0;
+			virtual void Suspend() = 0;
+			// Suspend, counted as blocked on reason until resumed
+			virtual void SuspendBlocked(BlockReason reason) = 0;
+		public: // one reusable timer per task, resumes the task when it fires
+			virtual int StartTimer(std::uint64_t ms) = 0;
+			virtual void StopTimer() = 0;
+		public: // intrusive link of the scheduler's ready queue
+			virtual IXTask*& ReadyLink() = 0;
+			virtual std::uint64_t& ReadyStamp() = 0; // when it was queued
+			virtual Priority GetPriority() const = 0;
+		public: // handles, the task is deleted with the last reference
+			virtual void AddRef() = 0;
+			virtual void Release() = 0;
+			// the routine returned, its stack and timer go, handles keep the rest
+			virtual void ReleaseFiber() = 0;
+			virtual bool IsFinished() const = 0;
+			virtual void AddJoiner(join_waiter* waiter) = 0;
+			virtual void RemoveJoiner(join_waiter* waiter) = 0;
+		public: // task locals, see TaskLocal
+			virtual void*& LocalSlot(int index) = 0;
+			// copies the inherited slots of the task that creates this one
+			virtual void InheritLocals(IXTask* parent) = 0;
+		public: // cancellation
+			typedef void(*cancel_hook)(IXTask* task, void* arg);
+			virtual void Cancel() = 0;
+			// only from the task itself, undoes the call it is blocked in, Cancel runs it once
+			virtual void SetCancelHook(cancel_hook hook, void* arg) = 0;
 		};
 
 		class IXScheduler : public IScheduler
 		{
 		public:
 			virtual void FreeTask(IXTask* task) = 0;
+			virtual void WakeupTask(IXTask* task) = 0;
+		public: // waits that another thread ends
+			// only from the task itself, keeps the loop alive until WakeupRemote
+			virtual void SuspendRemote(IXTask* task, BlockReason reason) = 0;
+			// from any thread, wakeups that arrive together share one loop iteration
+			virtual void WakeupRemote(IXTask* task) = 0;
 		public:
 			virtual FIBER_T GetFiber() const = 0;
 			virtual uv_loop_t* GetLoopContext() const = 0;
+			virtual watch_state* GetWatchState() = 0;
+			virtual scheduler_counters* GetCounters() = 0;
+			virtual loop_state* GetLoopState() = 0;
 		public: // socket register
+			typedef struct
+			{
+				uv_tcp_t* handle;
+				SocketOptions options;
+				int write_error; // first failed queued write or cancelled send, returned by later sends
+				int writes_pending; // queued write requests not called back yet
+				uv_os_sock_t listener; // accepted from
+				int connections; // listener, accepted sockets still open
+			}TCPCONTEXT;
 			virtual uv_os_sock_t CreateTcpSocket(int af) = 0;
 			virtual bool AttachTcpSocket(uv_os_sock_t s, uv_tcp_t* uv_handle = nullptr) = 0;
 			virtual bool DetachTcpSocket(uv_os_sock_t s) = 0;
 			virtual uv_tcp_t* QueryTcpSocket(uv_os_sock_t s) = 0;
+			virtual TCPCONTEXT* QueryTcpContext(uv_os_sock_t s) = 0;
+		public: // poll register, handles are kept until released
+			struct poll_waiter { IXTask* task; int result; };
+			struct poll_entry { uv_poll_t* handle; poll_waiter* reader; poll_waiter* writer; };
+			// errcode gets the uv error when create fails
+			virtual uv_poll_t* QueryPollHandle(uv_os_sock_t s, bool create, int* errcode = nullptr) = 0;
+			virtual bool ClosePollHandle(uv_os_sock_t s) = 0;
+		public: // resolver
+			virtual int ResolveHost(IXTask* task, const char* host, int af, struct sockaddr_storage* addr) = 0;
+		public: // connection pool
+			virtual uv_os_sock_t PoolConnect(IXTask* task, const struct sockaddr* name, int namelen) = 0;
+			virtual int PoolRelease(uv_os_sock_t s, bool reuse) = 0;
+		public: // io buffers, fixed size and reused
+			enum { io_buffer_size = 64 * 1024 };
+			virtual char* AllocBuffer() = 0;
+			virtual void FreeBuffer(char* buffer) = 0;
+		public: // write queue
+			virtual int QueueWrite(IXTask* task, uv_os_sock_t s, const uv_buf_t bufs[], unsigned int nbufs) = 0;
+			virtual int DrainWrites(IXTask* task, uv_os_sock_t s) = 0;
+		public: // overload protection
+			virtual void ThrottleAccept(IXTask* task, uv_os_sock_t s) = 0;
+		public: // run_blocking slots, false when the task was cancelled while waiting
+			virtual bool AcquireWorker(IXTask* task) = 0;
+			virtual void ReleaseWorker() = 0;
 		};
 
 		class CXTask : public IXTask
 		{
 		protected:
-			CXTask(IXScheduler* owner, Routine routine)
-				: m_owner(owner), m_routine(routine)
+			CXTask(IXScheduler* owner, Routine routine, Priority priority)
+				: m_owner(owner), m_routine(routine), m_timer(nullptr), m_ready_next(nullptr), m_ready_stamp(0), m_priority(priority),
+				m_refs(1), m_finished(false), m_cancelled(false), m_joiners(nullptr), m_cancel_hook(nullptr), m_cancel_arg(nullptr),
+				m_locals(), m_time_slice(default_time_slice * 1000), m_resumed_at(0), m_watch(owner->GetWatchState()),
+				m_counters(owner->GetCounters()), m_switches(), m_run_ns(), m_loop(owner->GetLoopState())
 			{
 				m_fiber = CreateFiberEx(0, 0, FIBER_FLAG_FLOAT_SWITCH, (LPFIBER_START_ROUTINE)_entry_point, this);
 				if (m_fiber == nullptr)
@@ -266,14 +819,15 @@ namespace libco
 			{
 				assert(GetCurrentFiber() != GetFiber());
 
-				DeleteFiber(m_fiber);
+				DestroyLocals();
+				ReleaseFiber();
 			}
 		public:
-			static IXTask* Create(IXScheduler* owner, Routine func)
+			static IXTask* Create(IXScheduler* owner, Routine func, Priority priority)
 			{
 				try
 				{
-					return new CXTask(owner, func);
+					return new CXTask(owner, func, priority);
 				}
 				catch (std::runtime_error&)
 				{
@@ -283,11 +837,28 @@ namespace libco
 			virtual void Delete() override { delete this; }
 		private:
 			void Run() { m_routine(this); }
+			// wakes the joiners, the closure goes now even if handles keep the task
+			void Finish()
+			{
+				DestroyLocals();
+				m_routine = nullptr;
+				m_finished = true;
+				while (join_waiter* waiter = m_joiners)
+				{
+					m_joiners = waiter->next;
+					if (!*waiter->fired)
+					{
+						*waiter->fired = true;
+						waiter->task->GetXOwner()->WakeupTask(waiter->task);
+					}
+				}
+			}
 			static VOID WINAPI _entry_point(CXTask* task)
 			{
 				IXScheduler* scheduler = task->GetXOwner();
 
 				task->Run();
+				task->Finish();
 				scheduler->FreeTask(task);
 				SwitchToFiber(scheduler->GetFiber());
 				assert(false); // do not back here
@@ -296,9 +867,192 @@ namespace libco
 			virtual FIBER_T GetFiber() const override { return m_fiber; }
 			virtual IScheduler* GetOwner() override { return m_owner; }
 			virtual IXScheduler* GetXOwner() const override { return m_owner; }
+		public:
+			virtual void Resume(std::uint64_t now = 0) override
+			{
+				IXTask*& current = CurrentTask();
+				IXTask* previous = current;
+
+				assert(GetCurrentFiber() != GetFiber());
+				current = this;
+				std::uint64_t resumed = m_resumed_at = (now != 0) ? now : uv_hrtime();
+				m_switches.add();
+				m_counters->switches.add();
+				if (now == 0)
+				{
+					// straight from an io or timer callback, it waited for the ones before it
+					if (m_loop->polling)
+					{
+						m_loop->polling = false;
+						m_loop->batch_start = resumed;
+					}
+					m_loop->timing[loop_wakeup].record(resumed - m_loop->batch_start);
+				}
+				if (m_watch->armed)
+				{
+					m_watch->preempt.store(false, std::memory_order_relaxed);
+					m_watch->task.store(this, std::memory_order_relaxed);
+					m_watch->since.store(m_resumed_at, std::memory_order_release);
+				}
+				SwitchToFiber(GetFiber());
+				current = previous;
+				if (m_watch->armed && (previous == nullptr))
+				{
+					m_watch->since.store(0, std::memory_order_release);
+				}
+				// SetTimeSlice moves m_resumed_at, the slice started here
+				std::uint64_t slice = uv_hrtime() - resumed;
+
+				m_run_ns.add(slice);
+				m_loop->timing[loop_slice].record(slice);
+			}
+			virtual void Suspend() override
+			{
+				assert(GetCurrentFiber() == GetFiber());
+				SwitchToFiber(GetXOwner()->GetFiber());
+			}
+			virtual void SuspendBlocked(BlockReason reason) override
+			{
+				stat_counter& blocked = m_counters->blocked[reason];
+
+				blocked.add();
+				Suspend();
+				blocked.sub();
+			}
+			virtual int StartTimer(std::uint64_t ms) override
+			{
+				if (m_timer == nullptr)
+				{
+					CXHandle Handle(GetXOwner()->GetLoopContext(), UV_TIMER);
+
+					Handle.SetXTask(this);
+					m_timer = Handle;
+				}
+				// restarting an armed timer replaces its timeout
+				return uv_timer_start(m_timer, [](uv_timer_t* handle) {
+					CXHandle Handle(handle);
+					IXTask* task = Handle.GetXTask();
+
+					task->GetXOwner()->GetCounters()->wakeups_timer.add();
+					task->Resume();
+				}, ms, 0);
+			}
+			virtual void StopTimer() override
+			{
+				if (m_timer != nullptr)
+				{
+					uv_timer_stop(m_timer);
+				}
+			}
+			virtual IXTask*& ReadyLink() override { return m_ready_next; }
+			virtual std::uint64_t& ReadyStamp() override { return m_ready_stamp; }
+			virtual Priority GetPriority() const override { return m_priority; }
+		public: // handles
+			virtual void AddRef() override { m_refs++; }
+			virtual void Release() override
+			{
+				if (--m_refs == 0)
+				{
+					Delete();
+				}
+			}
+			virtual void ReleaseFiber() override
+			{
+				if (m_timer != nullptr)
+				{
+					CXHandle(m_timer).Close();
+					m_timer = nullptr;
+				}
+				if (m_fiber != nullptr)
+				{
+					DeleteFiber(m_fiber);
+					m_fiber = nullptr;
+				}
+			}
+			virtual bool IsFinished() const override { return m_finished; }
+			virtual void AddJoiner(join_waiter* waiter) override
+			{
+				waiter->next = m_joiners;
+				m_joiners = waiter;
+			}
+			virtual void RemoveJoiner(join_waiter* waiter) override
+			{
+				for (join_waiter** link = &m_joiners; *link != nullptr; link = &(*link)->next)
+				{
+					if (*link == waiter)
+					{
+						*link = waiter->next;
+						break;
+					}
+				}
+			}
+		public: // task locals
+			virtual void*& LocalSlot(int index) override
+			{
+				assert((index >= 0) && (index < max_task_locals));
+				return m_locals[index];
+			}
+			virtual void InheritLocals(IXTask* parent) override
+			{
+				local_slot* slots = LocalSlots();
+				int count = (std::min)(LocalSlotCount(), (int)max_task_locals);
+
+				for (int i = 0; i < count; i++)
+				{
+					void* value = parent->LocalSlot(i);
+
+					if ((value != nullptr) && (slots[i].copy != nullptr))
+					{
+						m_locals[i] = slots[i].copy(value);
+					}
+				}
+			}
+			void DestroyLocals()
+			{
+				local_slot* slots = LocalSlots();
+
+				for (int i = 0; i < max_task_locals; i++)
+				{
+					if (void* value = m_locals[i])
+					{
+						m_locals[i] = nullptr;
+						slots[i].destroy(value);
+					}
+				}
+			}
+		public: // cancellation
+			virtual bool IsCancelled() override { return m_cancelled; }
+			virtual void Cancel() override
+			{
+				if (m_finished || m_cancelled)
+				{
+					return;
+				}
+				m_cancelled = true;
+				if (cancel_hook hook = m_cancel_hook)
+				{
+					m_cancel_hook = nullptr;
+					hook(this, m_cancel_arg);
+				}
+			}
+			virtual void SetCancelHook(cancel_hook hook, void* arg) override
+			{
+				m_cancel_hook = hook;
+				m_cancel_arg = arg;
+			}
 		public:
 			virtual bool Sleep(std::uint64_t ms) override
 			{
+				if (m_cancelled)
+				{
+					return false;
+				}
+				if (ms == 0)
+				{
+					// no timer needed to let the others run
+					Yield();
+					return !m_cancelled;
+				}
 				CXHandle sleep_handle(GetXOwner()->GetLoopContext(), UV_TIMER);
 
 				sleep_handle.SetXTask(this);
@@ -307,23 +1061,51 @@ namespace libco
 					IXTask* task = Handle.GetXTask();
 
 					// back to task
-					SwitchToFiber(task->GetFiber());
+					task->GetXOwner()->GetCounters()->wakeups_timer.add();
+					task->Resume();
 				}, ms, 0);
 				if (errcode == 0)
 				{
+					SetCancelHook([](IXTask* task, void* arg) {
+						uv_timer_stop((uv_timer_t*)arg);
+						task->GetXOwner()->WakeupTask(task);
+					}, (uv_timer_t*)sleep_handle);
 					// switch to Scheduler
-					SwitchToFiber(GetXOwner()->GetFiber());
+					SuspendBlocked(blocked_timer);
 					// come back, oh yeah !!!
+					SetCancelHook(nullptr, nullptr);
 				}
 				sleep_handle.Close();
-				return (errcode == 0);
+				return (errcode == 0) && !m_cancelled;
+			}
+			virtual void Yield() override
+			{
+				GetXOwner()->WakeupTask(this);
+				Suspend();
+			}
+			virtual bool MaybeYield() override
+			{
+				if (((m_time_slice > 0) && (uv_hrtime() - m_resumed_at >= m_time_slice)) || m_watch->preempt.load(std::memory_order_relaxed))
+				{
+					Yield();
+					return true;
+				}
+				return false;
+			}
+			virtual void SetTimeSlice(std::uint64_t us) override
+			{
+				m_time_slice = us * 1000;
+				m_resumed_at = uv_hrtime();
+			}
+			virtual void GetStats(TaskStats& stats) override
+			{
+				stats.switches = m_switches.get();
+				stats.run_ns = m_run_ns.get();
 			}
 		protected: // socket io struct ext
-			enum uv_exclude_type { uv_exclude_none, uv_exclude_recv, uv_exclude_listen };
-			struct uv_exclude_ext { uv_exclude_type type; };
 			struct uv_conn_ext : uv_connect_t { IXTask* task; int status; };
-			struct uv_send_ext : uv_write_t { IXTask* task; int status; };
-			struct uv_recv_ext : uv_exclude_ext { IXTask* task; char* buf; int len; ssize_t nread; };
+			struct uv_send_ext : uv_write_t { IXTask* task; int status; uv_os_sock_t sock; };
+			struct uv_recv_ext : uv_exclude_ext { IXTask* task; char* buf; int len; ssize_t nread; uv_tcp_t* handle; };
 			struct uv_shutdown_ext : uv_shutdown_t { IXTask* task; int status; };
 			struct uv_listen_ext : uv_exclude_ext { IXTask* task; int last_status; int queue_count; };
 		public: // socket
@@ -340,6 +1122,7 @@ namespace libco
 			}
 			virtual int closesocket(uv_os_sock_t s) override
 			{
+				GetXOwner()->DrainWrites(this, s);
 				return GetXOwner()->DetachTcpSocket(s);
 			}
 			virtual int connect(uv_os_sock_t s, const struct sockaddr* name, int namelen) override
@@ -358,48 +1141,134 @@ namespace libco
 						uv_conn_ext* reqx = (uv_conn_ext*)req;
 
 						reqx->status = status;
-						SwitchToFiber(reqx->task->GetFiber());
+						reqx->task->Resume();
 					});
 					if (errcode == 0)
 					{
-						SwitchToFiber(GetXOwner()->GetFiber());
+						SuspendBlocked(blocked_io);
 						status = reqx.status;
 					}
 				}
 				return status;
 			}
 			virtual int send(uv_os_sock_t s, const char* buf, int len) override
+			{
+				uv_buf_t uvbuf;
+
+				uvbuf.len = len;
+				uvbuf.base = (char*)buf;
+				return send(s, &uvbuf, 1);
+			}
+			virtual int send(uv_os_sock_t s, const uv_buf_t bufs[], unsigned int nbufs) override
 			{
 				int status = -1;
 
-				if (uv_tcp_t* tcp_handle = GetXOwner()->QueryTcpSocket(s))
+				if (m_cancelled)
+				{
+					return UV_ECANCELED;
+				}
+				std::uint64_t total = 0;
+
+				for (unsigned int i = 0; i < nbufs; i++)
+				{
+					total += bufs[i].len;
+				}
+				if (auto* ctx = GetXOwner()->QueryTcpContext(s))
 				{
 					int errcode;
-					uv_buf_t uvbuf;
 					uv_send_ext reqx;
+					uv_tcp_t* tcp_handle = ctx->handle;
+					uv_buf_t stack_bufs[16];
+
+					if (ctx->write_error != 0)
+					{
+						return ctx->write_error;
+					}
+					if (ctx->options.write_high > 0)
+					{
+						// queued bytes count as sent
+						if ((status = GetXOwner()->QueueWrite(this, s, bufs, nbufs)) == 0)
+						{
+							m_counters->bytes_out.add(total);
+						}
+						return status;
+					}
+					uv_buf_t* rest = stack_bufs;
 
-					uvbuf.len = len;
-					uvbuf.base = (char*)buf;
+					// write straight from the task while the kernel buffer has room,
+					// only what is left goes through a write request and the loop
+					int written = uv_try_write((uv_stream_t*)tcp_handle, bufs, nbufs);
+					if ((written < 0) && (written != UV_EAGAIN) && (written != UV_ENOSYS))
+					{
+						return written;
+					}
+					while ((nbufs > 0) && (written >= (int)bufs[0].len))
+					{
+						written -= (int)bufs[0].len;
+						bufs++;
+						nbufs--;
+					}
+					if (nbufs == 0)
+					{
+						m_counters->bytes_out.add(total);
+						return 0;
+					}
+					if (nbufs > _countof(stack_bufs))
+					{
+						rest = MemAlloc<uv_buf_t>(nbufs * sizeof(uv_buf_t));
+					}
+					memcpy(rest, bufs, nbufs * sizeof(uv_buf_t));
+					if (written > 0)
+					{
+						rest[0].len -= written;
+						rest[0].base += written;
+					}
 					reqx.task = this;
 					reqx.status = status;
-					errcode = uv_write(&reqx, (uv_stream_t*)tcp_handle, &uvbuf, 1, [](uv_write_t* req, int status) {
+					reqx.sock = s;
+					errcode = uv_write(&reqx, (uv_stream_t*)tcp_handle, rest, nbufs, [](uv_write_t* req, int status) {
 						uv_send_ext* reqx = (uv_send_ext*)req;
 
 						reqx->status = status;
-						SwitchToFiber(reqx->task->GetFiber());
+						reqx->task->Resume();
 					});
-					if (errcode == 0)
+					if (rest != stack_bufs)
 					{
-						SwitchToFiber(GetXOwner()->GetFiber());
-						status = reqx.status;
+						MemFree(rest); // libuv keeps its own copy of the list
 					}
-				}
-				return status;
-			}
-			virtual int recv(uv_os_sock_t s, char* buf, int len) override
+					if (errcode == 0)
+					{
+						// abort the write, its callback resumes us with UV_ECANCELED. part of
+						// the bytes may be out already, so the socket takes no more sends.
+						// only this request, a recv of another task on the socket goes on
+						SetCancelHook([](IXTask* task, void* arg) {
+							uv_send_ext* reqx = (uv_send_ext*)arg;
+
+							if (IXScheduler::TCPCONTEXT* ctx = task->GetXOwner()->QueryTcpContext(reqx->sock))
+							{
+								ctx->write_error = UV_ECANCELED;
+							}
+							CancelIoEx((HANDLE)reqx->sock, &reqx->u.io.overlapped);
+						}, &reqx);
+						SuspendBlocked(blocked_io);
+						SetCancelHook(nullptr, nullptr);
+						status = (m_cancelled && (reqx.status < 0)) ? UV_ECANCELED : reqx.status;
+						if (status == 0)
+						{
+							m_counters->bytes_out.add(total);
+						}
+					}
+				}
+				return status;
+			}
+			virtual int recv(uv_os_sock_t s, char* buf, int len) override
 			{
 				int status = -1;
 
+				if (m_cancelled)
+				{
+					return UV_ECANCELED;
+				}
 				if (uv_tcp_t* tcp_handle = GetXOwner()->QueryTcpSocket(s))
 				{
 					uv_recv_ext reqx;
@@ -410,6 +1279,7 @@ namespace libco
 					reqx.buf = buf;
 					reqx.len = len;
 					reqx.nread = status;
+					reqx.handle = tcp_handle;
 					if (Handle.SetExclude(&reqx))
 					{
 						int errcode = uv_read_start(Handle, [](uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
@@ -424,14 +1294,30 @@ namespace libco
 							uv_recv_ext* reqx = Handle.GetExclude<uv_recv_ext>();
 
 							assert(reqx->type == uv_exclude_recv);
+							if (nread == 0)
+							{
+								return; // EAGAIN, keep reading
+							}
 							reqx->nread = nread;
 							uv_read_stop(Handle);
-							SwitchToFiber(reqx->task->GetFiber());
+							reqx->task->Resume();
 						});
 						if (errcode == 0)
 						{
-							SwitchToFiber(GetXOwner()->GetFiber());
+							SetCancelHook([](IXTask* task, void* arg) {
+								uv_recv_ext* reqx = (uv_recv_ext*)arg;
+
+								uv_read_stop((uv_stream_t*)reqx->handle);
+								reqx->nread = UV_ECANCELED;
+								task->GetXOwner()->WakeupTask(task);
+							}, &reqx);
+							SuspendBlocked(blocked_io);
+							SetCancelHook(nullptr, nullptr);
 							status = reqx.nread;
+							if (status > 0)
+							{
+								m_counters->bytes_in.add(status);
+							}
 						}
 						Handle.ResetExclude();
 					}
@@ -450,11 +1336,11 @@ namespace libco
 						uv_shutdown_ext* reqx = (uv_shutdown_ext*)req;
 
 						reqx->status = status;
-						SwitchToFiber(reqx->task->GetFiber());
+						reqx->task->Resume();
 					});
 					if (errcode == 0)
 					{
-						SwitchToFiber(GetXOwner()->GetFiber());
+						SuspendBlocked(blocked_io);
 						errcode = reqx.status;
 					}
 					return errcode;
@@ -496,7 +1382,7 @@ namespace libco
 								reqx->last_status = status;
 								if (reqx->task != nullptr)
 								{
-									SwitchToFiber(reqx->task->GetFiber());
+									reqx->task->Resume();
 								}
 							}
 							else
@@ -515,7 +1401,7 @@ namespace libco
 					CXHandle server(tcp_handle);
 					uv_listen_ext* reqx = server.GetExclude<uv_listen_ext>();
 
-					auto _accept_stub = [this](CXHandle& server) -> uv_os_sock_t {
+					auto _accept_stub = [this, s](CXHandle& server) -> uv_os_sock_t {
 						CXHandle client(GetXOwner()->GetLoopContext(), UV_TCP);
 
 						if (uv_accept(server, client) == 0)
@@ -525,6 +1411,16 @@ namespace libco
 
 							if (GetXOwner()->AttachTcpSocket(uv_os_client, uv_tcp_client))
 							{
+								auto* server_ctx = GetXOwner()->QueryTcpContext(s);
+								auto* client_ctx = GetXOwner()->QueryTcpContext(uv_os_client);
+
+								client_ctx->options = server_ctx->options;
+								client_ctx->options.defer_accept = 0;
+								client_ctx->options.fastopen = 0;
+								client_ctx->options.max_connections = 0;
+								client_ctx->listener = s;
+								server_ctx->connections++;
+								ApplySocketOptions(uv_tcp_client, client_ctx->options, true);
 								return uv_os_client;
 							}
 						}
@@ -534,6 +1430,8 @@ namespace libco
 
 					if (((reqx != nullptr)) && (reqx->type == uv_exclude_listen))
 					{
+						// over a limit the backlog is left to the kernel
+						GetXOwner()->ThrottleAccept(this, s);
 						if (reqx->last_status == 0)
 						{
 							while (reqx->queue_count > 0)
@@ -549,7 +1447,7 @@ namespace libco
 							// no client coming
 							// wait for listen_callback wake up me
 							reqx->task = this;
-							SwitchToFiber(GetXOwner()->GetFiber());
+							SuspendBlocked(blocked_io);
 							reqx->task = nullptr;
 							if (reqx->last_status == 0)
 							{
@@ -567,168 +1465,2643 @@ namespace libco
 				}
 				return invalid_socket;
 			}
-		private:
-			FIBER_T m_fiber;
-			Routine m_routine;
-			IXScheduler* m_owner;
-		};
-
-		class CXScheduler : public IXScheduler
-		{
-		protected:
-			CXScheduler() : m_fiber(nullptr), m_loop_context(nullptr)
+			virtual int resolve(const char* host, int port, struct sockaddr* addr, int* addrlen, int af) override
 			{
-				m_was_converted = (IsThreadAFiber() != FALSE);
-				if (m_was_converted)
+				int errcode;
+				struct sockaddr_storage storage;
+
+				// numeric address never goes to the resolver
+				if ((af != AF_INET6) && (uv_ip4_addr(host, port, (struct sockaddr_in*)&storage) == 0))
 				{
-					m_fiber = GetCurrentFiber();
+					errcode = 0;
 				}
-				else
+				else if ((af != AF_INET) && (uv_ip6_addr(host, port, (struct sockaddr_in6*)&storage) == 0))
 				{
-					m_fiber = ConvertThreadToFiberEx(nullptr, FIBER_FLAG_FLOAT_SWITCH);
+					errcode = 0;
 				}
-				assert(m_fiber != nullptr);
+				else if ((errcode = GetXOwner()->ResolveHost(this, host, af, &storage)) == 0)
+				{
+					if (storage.ss_family == AF_INET6)
+					{
+						((struct sockaddr_in6*)&storage)->sin6_port = htons((unsigned short)port);
+					}
+					else
+					{
+						((struct sockaddr_in*)&storage)->sin_port = htons((unsigned short)port);
+					}
+				}
+				if (errcode == 0)
+				{
+					int namelen = (storage.ss_family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
 
-				size_t loop_size = uv_loop_size();
-				assert(loop_size > 0);
-				m_loop_context = MemAlloc<uv_loop_t>(loop_size);
-				int errcode = uv_loop_init(m_loop_context);
-				assert(errcode == 0);
-				m_loop_context->data = dynamic_cast<IXScheduler*>(this);
+					if (*addrlen < namelen)
+					{
+						return UV_ENOBUFS;
+					}
+					memcpy(addr, &storage, namelen);
+					*addrlen = namelen;
+				}
+				return errcode;
 			}
-			virtual ~CXScheduler()
+			virtual int setsockopt(uv_os_sock_t s, const SocketOptions& options) override
 			{
-				assert(GetCurrentFiber() == GetFiber());
-
-				do
+				if (auto* ctx = GetXOwner()->QueryTcpContext(s))
 				{
-					Peek();
-				} while (uv_loop_close(m_loop_context) == UV_EBUSY);
-				MemFree(m_loop_context);
-				m_loop_context = nullptr;
+					int errcode = ApplySocketOptions(ctx->handle, options, false);
 
-				if (!m_was_converted)
-				{
-					ConvertFiberToThread();
+					if (errcode == 0)
+					{
+						SocketOptions& merged = ctx->options;
+
+						merged.nodelay = options.nodelay ? options.nodelay : merged.nodelay;
+						merged.keepalive = options.keepalive ? options.keepalive : merged.keepalive;
+						merged.sndbuf = options.sndbuf ? options.sndbuf : merged.sndbuf;
+						merged.rcvbuf = options.rcvbuf ? options.rcvbuf : merged.rcvbuf;
+						merged.defer_accept = options.defer_accept ? options.defer_accept : merged.defer_accept;
+						merged.fastopen = options.fastopen ? options.fastopen : merged.fastopen;
+						merged.write_high = options.write_high ? options.write_high : merged.write_high;
+						merged.write_low = options.write_low ? options.write_low : merged.write_low;
+						merged.max_connections = options.max_connections ? options.max_connections : merged.max_connections;
+					}
+					return errcode;
 				}
+				return -1;
 			}
-		public:
-			static IScheduler* Create() { return new CXScheduler(); }
-			virtual void Delete() override { delete this; }
-		public:
-			virtual FIBER_T GetFiber() const override { return m_fiber; }
-			virtual uv_loop_t* GetLoopContext() const override { return m_loop_context; }
-		public:
-			virtual bool Peek() override
+		protected: // readiness
+			using poll_entry = IXScheduler::poll_entry;
+			using poll_waiter = IXScheduler::poll_waiter;
+
+			static int UpdatePoll(poll_entry* entry)
 			{
-				return (uv_run(GetLoopContext(), UV_RUN_NOWAIT) == 0);
+				int events = 0;
+
+				if (entry->reader != nullptr)
+				{
+					events |= UV_READABLE;
+				}
+				if (entry->writer != nullptr)
+				{
+					events |= UV_WRITABLE;
+				}
+				if (events == 0)
+				{
+					return uv_poll_stop(entry->handle);
+				}
+				return uv_poll_start(entry->handle, events, [](uv_poll_t* handle, int status, int events) {
+					CXHandle Handle(handle);
+					poll_entry* entry = Handle.GetExclude<poll_entry>();
+					poll_waiter* reader = nullptr;
+					poll_waiter* writer = nullptr;
+
+					if ((entry->reader != nullptr) && ((status < 0) || (events & UV_READABLE)))
+					{
+						reader = entry->reader;
+						reader->result = (status < 0) ? status : (events & ~UV_WRITABLE);
+						entry->reader = nullptr;
+					}
+					if ((entry->writer != nullptr) && ((status < 0) || (events & UV_WRITABLE)))
+					{
+						writer = entry->writer;
+						writer->result = (status < 0) ? status : (events & ~UV_READABLE);
+						entry->writer = nullptr;
+					}
+					UpdatePoll(entry);
+
+					// both are detached, entry may be released by the first one
+					if (reader != nullptr)
+					{
+						reader->task->Resume();
+					}
+					if (writer != nullptr)
+					{
+						writer->task->Resume();
+					}
+				});
 			}
-			virtual bool NewTask(Routine func) override
+			int WaitSocket(uv_os_sock_t s, int events, std::int64_t timeout)
 			{
-				if (IXTask* task = CXTask::Create(this, func))
+				int status = -1;
+
+				if (uv_poll_t* poll_handle = GetXOwner()->QueryPollHandle(s, true, &status))
 				{
-					CXHandle Handle(GetLoopContext(), UV_TIMER);
+					CXHandle Handle(poll_handle);
+					poll_entry* entry = Handle.GetExclude<poll_entry>();
+					poll_waiter waiter = { this, 0 };
+					poll_waiter*& slot = (events == UV_READABLE) ? entry->reader : entry->writer;
 
-					Handle.SetXTask(task);
-					int errcode = uv_timer_start(Handle, [](uv_timer_t* handle) {
-						CXHandle Handle(handle);
-						IXTask* task = Handle.GetXTask();
+					if (slot != nullptr)
+					{
+						return UV_EBUSY;
+					}
+					slot = &waiter;
 
-						Handle.Close();
-						SwitchToFiber(task->GetFiber());
-					}, 0, 0);
+					int errcode = UpdatePoll(entry);
+					if ((errcode == 0) && (timeout >= 0))
+					{
+						errcode = StartTimer(timeout);
+					}
 					if (errcode == 0)
 					{
-						return true;
+						SuspendBlocked(blocked_io);
+						StopTimer();
+						if (waiter.result != 0)
+						{
+							// poll callback or release already detached us
+							return waiter.result;
+						}
 					}
-					Handle.Close();
-					task->Delete();
+					slot = nullptr;
+					UpdatePoll(entry);
+					return errcode;
 				}
-				return false;
+				return status;
 			}
-			virtual void FreeTask(IXTask* task) override
+		public: // readiness
+			virtual int wait_readable(uv_os_sock_t s, std::int64_t timeout) override
 			{
-				CXHandle Handle(task->GetXOwner()->GetLoopContext(), UV_TIMER);
+				return WaitSocket(s, UV_READABLE, timeout);
+			}
+			virtual int wait_writable(uv_os_sock_t s, std::int64_t timeout) override
+			{
+				return WaitSocket(s, UV_WRITABLE, timeout);
+			}
+			virtual int wait_release(uv_os_sock_t s) override
+			{
+				return GetXOwner()->ClosePollHandle(s) ? 0 : -1;
+			}
+		public: // connection pool
+			virtual uv_os_sock_t pool_connect(const struct sockaddr* name, int namelen) override
+			{
+				return GetXOwner()->PoolConnect(this, name, namelen);
+			}
+			virtual int pool_release(uv_os_sock_t s, bool reuse) override
+			{
+				return GetXOwner()->PoolRelease(s, reuse);
+			}
+		protected: // proxy
+			enum { relay_inflight = 4 }; // buffers written but not done per direction before reading stops
 
-				Handle.SetXTask(task);
-				int errcode = uv_timer_start(Handle, [](uv_timer_t* handle) {
-					CXHandle Handle(handle);
-					IXTask* task = Handle.GetXTask();
+			struct uv_relay_ext;
+			struct relay_side { uv_stream_t* from; uv_stream_t* to; int inflight; bool reading; bool eof; bool done; };
+			// header of a pooled buffer, the data follows it
+			struct uv_relay_write_ext : uv_write_t { uv_relay_ext* relay; relay_side* side; };
+			struct uv_relay_shutdown_ext : uv_shutdown_t { uv_relay_ext* relay; relay_side* side; };
+			struct uv_relay_ext : uv_exclude_ext
+			{
+				IXTask* task;
+				relay_side sides[2];
+				uv_relay_shutdown_ext shutdowns[2];
+				int pending; // writes and shutdowns not called back yet
+				int status;
+			};
 
-					Handle.Close();
-					task->Delete();
-				}, 0, 0);
-				if (errcode != 0)
-				{
-					throw std::runtime_error("Free task error");
-				}
+			static relay_side* RelaySide(uv_relay_ext* relay, uv_stream_t* from)
+			{
+				return (relay->sides[0].from == from) ? &relay->sides[0] : &relay->sides[1];
 			}
-		public: // socket
-			virtual uv_os_sock_t CreateTcpSocket(int af) override
+			static int RelayRead(relay_side* side)
 			{
-				uv_os_sock_t sock = ::socket(af, SOCK_STREAM, IPPROTO_TCP);
+				side->reading = true;
+				return uv_read_start(side->from, [](uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+					uv_relay_ext* relay = CXHandle(handle).GetExclude<uv_relay_ext>();
+					char* buffer = relay->task->GetXOwner()->AllocBuffer();
 
-				if (sock != invalid_socket)
+					*buf = uv_buf_init(buffer + sizeof(uv_relay_write_ext), (unsigned int)(IXScheduler::io_buffer_size - sizeof(uv_relay_write_ext)));
+				}, [](uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+					uv_relay_ext* relay = CXHandle(stream).GetExclude<uv_relay_ext>();
+					relay_side* side = RelaySide(relay, stream);
+					char* buffer = (buf->base != nullptr) ? buf->base - sizeof(uv_relay_write_ext) : nullptr;
+
+					if (nread > 0)
+					{
+						// the read buffer itself is written, nothing is copied
+						auto* reqx = (uv_relay_write_ext*)buffer;
+						uv_buf_t data = uv_buf_init(buf->base, (unsigned int)nread);
+						scheduler_counters* counters = relay->task->GetXOwner()->GetCounters();
+
+						counters->bytes_in.add(nread);
+						counters->bytes_out.add(nread);
+						reqx->relay = relay;
+						reqx->side = side;
+						int errcode = uv_write(reqx, side->to, &data, 1, [](uv_write_t* req, int status) {
+							auto* reqx = (uv_relay_write_ext*)req;
+							uv_relay_ext* relay = reqx->relay;
+							relay_side* side = reqx->side;
+
+							relay->task->GetXOwner()->FreeBuffer((char*)reqx);
+							relay->pending--;
+							side->inflight--;
+							if (status < 0)
+							{
+								RelayAbort(relay, status);
+							}
+							else if (side->eof)
+							{
+								RelayShutdown(relay, side);
+							}
+							else if (!side->reading && (side->inflight < relay_inflight) && (relay->status == 0))
+							{
+								RelayRead(side);
+							}
+							RelayCheck(relay);
+						});
+						if (errcode != 0)
+						{
+							relay->task->GetXOwner()->FreeBuffer(buffer);
+							RelayAbort(relay, errcode);
+						}
+						else
+						{
+							relay->pending++;
+							if (++side->inflight >= relay_inflight)
+							{
+								// the other side is slower, let the kernel buffer fill up
+								uv_read_stop(stream);
+								side->reading = false;
+							}
+						}
+					}
+					else
+					{
+						if (buffer != nullptr)
+						{
+							relay->task->GetXOwner()->FreeBuffer(buffer);
+						}
+						if (nread == UV_EOF)
+						{
+							uv_read_stop(stream);
+							side->reading = false;
+							side->eof = true;
+							RelayShutdown(relay, side);
+						}
+						else if (nread < 0)
+						{
+							RelayAbort(relay, (int)nread);
+						}
+					}
+					RelayCheck(relay);
+				});
+			}
+			// half-close once everything read from one peer reached the other
+			static void RelayShutdown(uv_relay_ext* relay, relay_side* side)
+			{
+				if ((side->inflight > 0) || side->done)
 				{
-					if (AttachTcpSocket(sock))
+					return;
+				}
+
+				uv_relay_shutdown_ext* reqx = &relay->shutdowns[side - relay->sides];
+
+				side->done = true;
+				reqx->relay = relay;
+				reqx->side = side;
+				if (uv_shutdown(reqx, side->to, [](uv_shutdown_t* req, int status) {
+					auto* reqx = (uv_relay_shutdown_ext*)req;
+					uv_relay_ext* relay = reqx->relay;
+
+					relay->pending--;
+					if ((status < 0) && (status != UV_ENOTCONN))
 					{
-						return sock;
+						RelayAbort(relay, status);
 					}
-					::closesocket(sock);
+					RelayCheck(relay);
+				}) == 0)
+				{
+					relay->pending++;
 				}
-				return invalid_socket;
 			}
-			virtual bool AttachTcpSocket(uv_os_sock_t s, uv_tcp_t* uv_handle = nullptr) override
+			static void RelayAbort(uv_relay_ext* relay, int status)
 			{
-				if (QueryTcpSocket(s) == nullptr)
+				if (relay->status == 0)
 				{
-					if (uv_handle != nullptr)
+					relay->status = status;
+				}
+				for (relay_side& side : relay->sides)
+				{
+					if (side.reading)
 					{
-						m_tcp_table[s] = uv_handle;
-						return true;
+						uv_read_stop(side.from);
+						side.reading = false;
 					}
-					else
-					{
-						CXHandle handle(GetLoopContext(), UV_TCP);
+					side.done = true;
+				}
+			}
+			// the task goes on when no callback can reach the relay any more
+			static void RelayCheck(uv_relay_ext* relay)
+			{
+				if (relay->sides[0].done && relay->sides[1].done && (relay->pending == 0) && (relay->task != nullptr))
+				{
+					IXTask* task = relay->task;
 
-						if (uv_tcp_open(handle, s) == 0)
-						{
-							m_tcp_table[s] = handle;
-							return true;
-						}
-						handle.Close();
-					}
+					relay->task = nullptr;
+					task->Resume();
 				}
-				return false;
 			}
-			virtual bool DetachTcpSocket(uv_os_sock_t s) override
+		public: // proxy
+			// on linux splice could skip user space, libuv has no such path on
+			// windows, so every pooled buffer is written out as it was read
+			virtual int relay(uv_os_sock_t a, uv_os_sock_t b) override
 			{
-				if (uv_tcp_t* tcp_handle = QueryTcpSocket(s))
+				uv_tcp_t* tcp_a = GetXOwner()->QueryTcpSocket(a);
+				uv_tcp_t* tcp_b = GetXOwner()->QueryTcpSocket(b);
+
+				if ((tcp_a == nullptr) || (tcp_b == nullptr) || (tcp_a == tcp_b))
 				{
-					m_tcp_table.erase(s);
-					CXHandle(tcp_handle).Close();
-					return true;
+					return -1;
 				}
-				return false;
+
+				CXHandle Handle_a(tcp_a), Handle_b(tcp_b);
+				uv_relay_ext reqx;
+
+				memset(&reqx, 0, sizeof(reqx));
+				reqx.type = uv_exclude_relay;
+				reqx.task = this;
+				reqx.sides[0].from = reqx.sides[1].to = (uv_stream_t*)tcp_a;
+				reqx.sides[0].to = reqx.sides[1].from = (uv_stream_t*)tcp_b;
+				if (!Handle_a.SetExclude(&reqx))
+				{
+					return UV_EBUSY;
+				}
+				if (!Handle_b.SetExclude(&reqx))
+				{
+					Handle_a.ResetExclude();
+					return UV_EBUSY;
+				}
+
+				int errcode = RelayRead(&reqx.sides[0]);
+				if (errcode == 0)
+				{
+					errcode = RelayRead(&reqx.sides[1]);
+				}
+				if (errcode != 0)
+				{
+					RelayAbort(&reqx, errcode);
+				}
+				// callbacks resume us once both sides are done, unless nothing was started
+				if (!reqx.sides[0].done || !reqx.sides[1].done || (reqx.pending > 0))
+				{
+					SuspendBlocked(blocked_io);
+				}
+				Handle_a.ResetExclude();
+				Handle_b.ResetExclude();
+				return reqx.status;
 			}
-			virtual uv_tcp_t* QueryTcpSocket(uv_os_sock_t s) override
+		protected: // socket option
+			// accepted sockets get everything but the listener only options, windows
+			// does not promise that AcceptEx sockets inherit them
+			static int ApplySocketOptions(uv_tcp_t* tcp_handle, const SocketOptions& options, bool accepted)
 			{
-				auto tcp_iter = m_tcp_table.find(s);
-				if (tcp_iter != m_tcp_table.end())
+				int errcode = 0;
+				uv_os_sock_t s = tcp_handle->socket;
+
+				if ((errcode == 0) && (options.nodelay != 0))
 				{
-					return tcp_iter->second;
+					errcode = uv_tcp_nodelay(tcp_handle, (options.nodelay > 0) ? 1 : 0);
 				}
-				return nullptr;
+				if ((errcode == 0) && (options.sndbuf != 0))
+				{
+					int value = options.sndbuf;
+					errcode = uv_send_buffer_size((uv_handle_t*)tcp_handle, &value);
+				}
+				if ((errcode == 0) && (options.rcvbuf != 0))
+				{
+					int value = options.rcvbuf;
+					errcode = uv_recv_buffer_size((uv_handle_t*)tcp_handle, &value);
+				}
+				if ((errcode == 0) && (options.keepalive != 0))
+				{
+					errcode = uv_tcp_keepalive(tcp_handle, (options.keepalive > 0) ? 1 : 0, (options.keepalive > 0) ? options.keepalive : 0);
+				}
+				if (accepted)
+				{
+					return errcode;
+				}
+				if ((errcode == 0) && (options.defer_accept != 0))
+				{
+#ifdef TCP_DEFER_ACCEPT
+					int value = options.defer_accept;
+					if (::setsockopt(s, IPPROTO_TCP, TCP_DEFER_ACCEPT, (const char*)&value, sizeof(value)) != 0)
+					{
+						errcode = uv_translate_sys_error(WSAGetLastError());
+					}
+#else
+					errcode = UV_ENOTSUP;
+#endif
+				}
+				if ((errcode == 0) && (options.fastopen != 0))
+				{
+#ifdef TCP_FASTOPEN
+					int value = options.fastopen;
+					if (::setsockopt(s, IPPROTO_TCP, TCP_FASTOPEN, (const char*)&value, sizeof(value)) != 0)
+					{
+						errcode = uv_translate_sys_error(WSAGetLastError());
+					}
+#else
+					errcode = UV_ENOTSUP;
+#endif
+				}
+				return errcode;
 			}
-		private:
-			FIBER_T m_fiber;
-			bool m_was_converted;
-			uv_loop_t* m_loop_context;
+		protected: // file io struct ext
+			struct uv_fs_ext : uv_fs_t { IXTask* task; };
+			struct uv_fs_batch_ext : uv_work_t { IXTask* task; FileRead* reads; int count; int status; };
+			struct uv_work_ext : uv_work_t { IXTask* task; std::function<void()>* routine; int status; };
 
-			std::unordered_map<uv_os_sock_t, uv_tcp_t*> m_tcp_table;
-		};
-	} // namespace impl
+			static void _fs_callback(uv_fs_t* req)
+			{
+				uv_fs_ext* reqx = (uv_fs_ext*)req;
 
-	IScheduler* CreateScheduler() { return impl::CXScheduler::Create(); }
+				reqx->task->Resume();
+			}
+			ssize_t fs_wait(uv_fs_ext& reqx, int errcode, uv_stat_t* statbuf = nullptr)
+			{
+				ssize_t result = errcode;
+
+				if (errcode == 0)
+				{
+					SuspendBlocked(blocked_io);
+					result = reqx.result;
+					if ((statbuf != nullptr) && (result == 0))
+					{
+						*statbuf = reqx.statbuf;
+					}
+					uv_fs_req_cleanup(&reqx);
+				}
+				return result;
+			}
+		public: // file
+			virtual uv_file open(const char* path, int flags, int mode) override
+			{
+				uv_fs_ext reqx;
+
+				reqx.task = this;
+				return (uv_file)fs_wait(reqx, uv_fs_open(GetXOwner()->GetLoopContext(), &reqx, path, flags, mode, _fs_callback));
+			}
+			virtual int close(uv_file file) override
+			{
+				uv_fs_ext reqx;
+
+				reqx.task = this;
+				return (int)fs_wait(reqx, uv_fs_close(GetXOwner()->GetLoopContext(), &reqx, file, _fs_callback));
+			}
+			virtual ssize_t read(uv_file file, char* buf, unsigned int len) override
+			{
+				return pread(file, buf, len, -1);
+			}
+			virtual ssize_t write(uv_file file, const char* buf, unsigned int len) override
+			{
+				return pwrite(file, buf, len, -1);
+			}
+			virtual ssize_t pread(uv_file file, char* buf, unsigned int len, std::int64_t offset) override
+			{
+				uv_fs_ext reqx;
+				uv_buf_t uvbuf = uv_buf_init(buf, len);
+
+				reqx.task = this;
+				return fs_wait(reqx, uv_fs_read(GetXOwner()->GetLoopContext(), &reqx, file, &uvbuf, 1, offset, _fs_callback));
+			}
+			virtual ssize_t pwrite(uv_file file, const char* buf, unsigned int len, std::int64_t offset) override
+			{
+				uv_fs_ext reqx;
+				uv_buf_t uvbuf = uv_buf_init((char*)buf, len);
+
+				reqx.task = this;
+				return fs_wait(reqx, uv_fs_write(GetXOwner()->GetLoopContext(), &reqx, file, &uvbuf, 1, offset, _fs_callback));
+			}
+			virtual int fsync(uv_file file) override
+			{
+				uv_fs_ext reqx;
+
+				reqx.task = this;
+				return (int)fs_wait(reqx, uv_fs_fsync(GetXOwner()->GetLoopContext(), &reqx, file, _fs_callback));
+			}
+			virtual int stat(const char* path, uv_stat_t* statbuf) override
+			{
+				uv_fs_ext reqx;
+
+				reqx.task = this;
+				return (int)fs_wait(reqx, uv_fs_stat(GetXOwner()->GetLoopContext(), &reqx, path, _fs_callback), statbuf);
+			}
+			virtual int read_batch(FileRead* reads, int count) override
+			{
+				uv_fs_batch_ext reqx;
+
+				reqx.task = this;
+				reqx.reads = reads;
+				reqx.count = count;
+				reqx.status = -1;
+				int errcode = uv_queue_work(GetXOwner()->GetLoopContext(), &reqx, [](uv_work_t* req) {
+					uv_fs_batch_ext* reqx = (uv_fs_batch_ext*)req;
+
+					// on a threadpool thread, so the sync form of uv_fs_read is fine here
+					for (int i = 0; i < reqx->count; i++)
+					{
+						uv_fs_t fsreq;
+						FileRead& rd = reqx->reads[i];
+						uv_buf_t uvbuf = uv_buf_init(rd.buf, rd.len);
+
+						rd.result = uv_fs_read(req->loop, &fsreq, rd.file, &uvbuf, 1, rd.offset, nullptr);
+						uv_fs_req_cleanup(&fsreq);
+					}
+				}, [](uv_work_t* req, int status) {
+					uv_fs_batch_ext* reqx = (uv_fs_batch_ext*)req;
+
+					reqx->status = status;
+					reqx->task->Resume();
+				});
+				if (errcode == 0)
+				{
+					SuspendBlocked(blocked_io);
+					errcode = reqx.status;
+				}
+				return errcode;
+			}
+		public: // cpu bound work
+			virtual int run_blocking(std::function<void()> routine) override
+			{
+				if (m_cancelled || !GetXOwner()->AcquireWorker(this))
+				{
+					return UV_ECANCELED;
+				}
+				uv_work_ext reqx;
+
+				reqx.task = this;
+				reqx.routine = &routine;
+				reqx.status = -1;
+				int errcode = uv_queue_work(GetXOwner()->GetLoopContext(), &reqx, [](uv_work_t* req) {
+					(*((uv_work_ext*)req)->routine)();
+				}, [](uv_work_t* req, int status) {
+					uv_work_ext* reqx = (uv_work_ext*)req;
+
+					reqx->status = status;
+					reqx->task->Resume();
+				});
+				if (errcode == 0)
+				{
+					// only work no thread took yet can be cancelled, the callback resumes us either way
+					SetCancelHook([](IXTask* task, void* arg) {
+						uv_cancel((uv_req_t*)arg);
+					}, &reqx);
+					SuspendBlocked(blocked_pool);
+					SetCancelHook(nullptr, nullptr);
+					errcode = reqx.status;
+				}
+				GetXOwner()->ReleaseWorker();
+				return errcode;
+			}
+		private:
+			FIBER_T m_fiber;
+			Routine m_routine;
+			IXScheduler* m_owner;
+			uv_timer_t* m_timer;
+			IXTask* m_ready_next;
+			std::uint64_t m_ready_stamp;
+			Priority m_priority;
+
+			int m_refs; // the running routine holds one, every handle one more
+			bool m_finished;
+			bool m_cancelled;
+			join_waiter* m_joiners;
+			cancel_hook m_cancel_hook;
+			void* m_cancel_arg;
+
+			void* m_locals[max_task_locals];
+
+			enum { default_time_slice = 2000 }; // us
+			std::uint64_t m_time_slice; // ns
+			std::uint64_t m_resumed_at;
+			watch_state* m_watch;
+
+			scheduler_counters* m_counters;
+			stat_counter m_switches;
+			stat_counter m_run_ns;
+			loop_state* m_loop;
+		};
+
+		class CXScheduler : public IXScheduler
+		{
+		protected:
+			CXScheduler() : m_fiber(nullptr), m_loop_context(nullptr), m_pool_limit(pool_default_limit),
+				m_write_high(0), m_write_low(0), m_write_queued(0), m_write_waiters(nullptr),
+				m_task_count(0), m_task_limit(0), m_max_lag(0), m_max_rss(0), m_overloaded(false), m_overload_timer(nullptr), m_overload_tick(0), m_accept_waiters(nullptr),
+				m_work_limit(0), m_work_running(0), m_work_head(nullptr), m_work_tail(nullptr),
+				m_ready_head(), m_ready_tail(), m_ready_count(), m_remote_head(nullptr), m_remote_waiting(0),
+				m_counters(), m_loop(), m_loop_prepare(nullptr), m_loop_check(nullptr), m_watch(), m_watch_threshold(0), m_watch_preempt(false), m_watch_stop(false), m_watch_running(false)
+			{
+				m_was_converted = (IsThreadAFiber() != FALSE);
+				if (m_was_converted)
+				{
+					m_fiber = GetCurrentFiber();
+				}
+				else
+				{
+					m_fiber = ConvertThreadToFiberEx(nullptr, FIBER_FLAG_FLOAT_SWITCH);
+				}
+				assert(m_fiber != nullptr);
+
+				size_t loop_size = uv_loop_size();
+				assert(loop_size > 0);
+				m_loop_context = MemAlloc<uv_loop_t>(loop_size);
+				int errcode = uv_loop_init(m_loop_context);
+				assert(errcode == 0);
+				m_loop_context->data = dynamic_cast<IXScheduler*>(this);
+
+				// libuv reads the same variable when it starts the threadpool
+				const char* threads = getenv("UV_THREADPOOL_SIZE");
+				m_work_limit = (std::max)(1, ((threads != nullptr) ? atoi(threads) : 4) / 2);
+				m_ready_idle = CXHandle(m_loop_context, UV_IDLE);
+				m_remote_async = CXHandle(m_loop_context, [](uv_async_t* handle) {
+					auto* scheduler = (CXScheduler*)(IXScheduler*)handle->loop->data;
+
+					scheduler->RunRemote();
+				});
+				// referenced only while a task waits on it
+				uv_unref(CXHandle(m_remote_async));
+				// the poll is entered between these two, timing alone does not keep the loop alive
+				m_loop.batch_start = uv_hrtime();
+				m_loop_prepare = CXHandle(m_loop_context, UV_PREPARE);
+				uv_prepare_start(m_loop_prepare, [](uv_prepare_t* handle) {
+					auto* scheduler = (CXScheduler*)(IXScheduler*)handle->loop->data;
+
+					scheduler->m_loop.prepared = uv_hrtime();
+					scheduler->m_loop.polling = true;
+				});
+				uv_unref(CXHandle(m_loop_prepare));
+				m_loop_check = CXHandle(m_loop_context, UV_CHECK);
+				uv_check_start(m_loop_check, [](uv_check_t* handle) {
+					auto* scheduler = (CXScheduler*)(IXScheduler*)handle->loop->data;
+
+					scheduler->LoopChecked();
+				});
+				uv_unref(CXHandle(m_loop_check));
+				uv_mutex_init(&m_watch_mutex);
+				uv_cond_init(&m_watch_cond);
+			}
+			virtual ~CXScheduler()
+			{
+				assert(GetCurrentFiber() == GetFiber());
+
+				StopWatchdog();
+				uv_cond_destroy(&m_watch_cond);
+				uv_mutex_destroy(&m_watch_mutex);
+
+				do
+				{
+					// sampling timer and ready queue go last, tasks still running may use them
+					if (Peek())
+					{
+						if (m_overload_timer != nullptr)
+						{
+							CXHandle(m_overload_timer).Close();
+							m_overload_timer = nullptr;
+						}
+						if (m_ready_idle != nullptr)
+						{
+							CXHandle(m_ready_idle).Close();
+							m_ready_idle = nullptr;
+						}
+						if (m_remote_async != nullptr)
+						{
+							CXHandle(m_remote_async).Close();
+							m_remote_async = nullptr;
+						}
+						if (m_loop_prepare != nullptr)
+						{
+							CXHandle(m_loop_prepare).Close();
+							CXHandle(m_loop_check).Close();
+							m_loop_prepare = nullptr;
+							m_loop_check = nullptr;
+						}
+					}
+				} while (uv_loop_close(m_loop_context) == UV_EBUSY);
+				MemFree(m_loop_context);
+				for (char* buffer : m_buffers)
+				{
+					MemFree(buffer);
+				}
+				m_loop_context = nullptr;
+
+				if (!m_was_converted)
+				{
+					ConvertFiberToThread();
+				}
+			}
+		public:
+			static IScheduler* Create() { return new CXScheduler(); }
+			virtual void Delete() override { delete this; }
+		public:
+			virtual FIBER_T GetFiber() const override { return m_fiber; }
+			virtual uv_loop_t* GetLoopContext() const override { return m_loop_context; }
+			virtual watch_state* GetWatchState() override { return &m_watch; }
+			virtual scheduler_counters* GetCounters() override { return &m_counters; }
+			virtual loop_state* GetLoopState() override { return &m_loop; }
+		public:
+			virtual bool Peek() override
+			{
+				return (uv_run(GetLoopContext(), UV_RUN_NOWAIT) == 0);
+			}
+			virtual TaskHandle NewTask(Routine func, Priority priority = priority_normal) override
+			{
+				assert((priority >= 0) && (priority < priority_classes));
+
+				if (IXTask* task = CXTask::Create(this, func, priority))
+				{
+					if (IXTask* parent = CurrentTask())
+					{
+						task->InheritLocals(parent);
+					}
+					// starts from the ready queue of its class
+					m_task_count++;
+					m_counters.tasks_created.add();
+					WakeupTask(task);
+					return TaskHandle(task);
+				}
+				return TaskHandle();
+			}
+			virtual const Histogram& ReadyLatency(Priority priority) override
+			{
+				assert((priority >= 0) && (priority < priority_classes));
+				return m_ready_latency[priority];
+			}
+			virtual void FreeTask(IXTask* task) override
+			{
+				m_counters.tasks_finished.add();
+				if ((--m_task_count < m_task_limit) && (m_task_limit > 0))
+				{
+					NotifyAccept();
+				}
+				CXHandle Handle(task->GetXOwner()->GetLoopContext(), UV_TIMER);
+
+				Handle.SetXTask(task);
+				int errcode = uv_timer_start(Handle, [](uv_timer_t* handle) {
+					CXHandle Handle(handle);
+					IXTask* task = Handle.GetXTask();
+
+					// off the task's fiber now, handles only keep the small state
+					Handle.Close();
+					task->ReleaseFiber();
+					task->Release();
+				}, 0, 0);
+				if (errcode != 0)
+				{
+					throw std::runtime_error("Free task error");
+				}
+			}
+			// never switch from one task to another, go through the loop. the
+			// task is linked into the ready queue of its class, nothing is allocated
+			virtual void WakeupTask(IXTask* task) override
+			{
+				assert(task->ReadyLink() == nullptr);
+				int priority = task->GetPriority();
+
+				if ((m_ready_count[0] + m_ready_count[1] + m_ready_count[2]) == 0)
+				{
+					uv_idle_start(m_ready_idle, [](uv_idle_t* handle) {
+						auto* scheduler = (CXScheduler*)(IXScheduler*)handle->loop->data;
+
+						scheduler->RunReady();
+					});
+				}
+				if (m_ready_tail[priority] != nullptr)
+				{
+					m_ready_tail[priority]->ReadyLink() = task;
+				}
+				else
+				{
+					m_ready_head[priority] = task;
+				}
+				m_ready_tail[priority] = task;
+				m_ready_count[priority]++;
+				m_counters.ready_queued.add();
+				task->ReadyStamp() = uv_hrtime();
+			}
+			// higher classes first. while a higher class has work a lower one only
+			// runs its weight of tasks, the rest waits behind the next io poll. tasks
+			// woken while running the batch wait for the next loop iteration
+			void RunReady()
+			{
+				static const int weights[priority_classes] = { 0, 4, 1 };
+				int share[priority_classes];
+				bool higher = false;
+
+				for (int i = 0; i < priority_classes; i++)
+				{
+					share[i] = m_ready_count[i];
+					if (higher && (share[i] > weights[i]))
+					{
+						share[i] = weights[i];
+					}
+					higher = higher || (m_ready_count[i] > 0);
+				}
+				for (int i = 0; i < priority_classes; i++)
+				{
+					for (; share[i] > 0; share[i]--)
+					{
+						IXTask* task = m_ready_head[i];
+						std::uint64_t now = uv_hrtime();
+
+						if ((m_ready_head[i] = task->ReadyLink()) == nullptr)
+						{
+							m_ready_tail[i] = nullptr;
+						}
+						m_ready_count[i]--;
+						m_counters.wakeups_ready.add();
+						task->ReadyLink() = nullptr;
+						m_ready_latency[i].record(now - task->ReadyStamp());
+						task->Resume(now);
+					}
+				}
+				if ((m_ready_count[0] + m_ready_count[1] + m_ready_count[2]) == 0)
+				{
+					uv_idle_stop(m_ready_idle);
+				}
+			}
+			virtual void SuspendRemote(IXTask* task, BlockReason reason) override
+			{
+				if (m_remote_waiting++ == 0)
+				{
+					uv_ref(CXHandle(m_remote_async));
+				}
+				task->SuspendBlocked(reason);
+				if (--m_remote_waiting == 0)
+				{
+					uv_unref(CXHandle(m_remote_async));
+				}
+			}
+			// pushed on a lock-free stack, only the first push of a batch signals the loop
+			virtual void WakeupRemote(IXTask* task) override
+			{
+				IXTask* current = CurrentTask();
+
+				if ((current != nullptr) && (current->GetXOwner() == this))
+				{
+					WakeupTask(task);
+					return;
+				}
+				IXTask* head = m_remote_head.load(std::memory_order_relaxed);
+				do
+				{
+					task->ReadyLink() = head;
+				} while (!m_remote_head.compare_exchange_weak(head, task, std::memory_order_release, std::memory_order_relaxed));
+				if (head == nullptr)
+				{
+					uv_async_send(m_remote_async);
+				}
+			}
+			// moves the remote stack into the ready queue, oldest first
+			void RunRemote()
+			{
+				IXTask* task = m_remote_head.exchange(nullptr, std::memory_order_acquire);
+				IXTask* order = nullptr;
+
+				while (task != nullptr)
+				{
+					IXTask* next = task->ReadyLink();
+
+					task->ReadyLink() = order;
+					order = task;
+					task = next;
+				}
+				while (order != nullptr)
+				{
+					IXTask* next = order->ReadyLink();
+
+					order->ReadyLink() = nullptr;
+					m_counters.wakeups_remote.add();
+					WakeupTask(order);
+					order = next;
+				}
+			}
+		public: // socket
+			virtual uv_os_sock_t CreateTcpSocket(int af) override
+			{
+				uv_os_sock_t sock = RawWinsock().socket(af, SOCK_STREAM, IPPROTO_TCP);
+
+				if (sock != invalid_socket)
+				{
+					if (AttachTcpSocket(sock))
+					{
+						return sock;
+					}
+					RawWinsock().closesocket(sock);
+				}
+				return invalid_socket;
+			}
+			virtual bool AttachTcpSocket(uv_os_sock_t s, uv_tcp_t* uv_handle = nullptr) override
+			{
+				if (QueryTcpSocket(s) == nullptr)
+				{
+					if (uv_handle != nullptr)
+					{
+						m_tcp_table[s].handle = uv_handle;
+						m_tcp_table[s].listener = invalid_socket;
+						m_counters.sockets_opened.add();
+						return true;
+					}
+					else
+					{
+						CXHandle handle(GetLoopContext(), UV_TCP);
+
+						if (uv_tcp_open(handle, s) == 0)
+						{
+							m_tcp_table[s].handle = handle;
+							m_tcp_table[s].listener = invalid_socket;
+							m_counters.sockets_opened.add();
+							return true;
+						}
+						handle.Close();
+					}
+				}
+				return false;
+			}
+			virtual bool DetachTcpSocket(uv_os_sock_t s) override
+			{
+				if (TCPCONTEXT* ctx = QueryTcpContext(s))
+				{
+					uv_tcp_t* tcp_handle = ctx->handle;
+					TCPCONTEXT* listener_ctx = QueryTcpContext(ctx->listener);
+
+					if ((listener_ctx != nullptr) && (listener_ctx->connections > 0))
+					{
+						listener_ctx->connections--;
+						NotifyAccept();
+					}
+					// the number may be reused by a new listener, forget it on the sockets it accepted
+					if (ctx->connections > 0)
+					{
+						for (auto& tcp_iter : m_tcp_table)
+						{
+							if (tcp_iter.second.listener == s)
+							{
+								tcp_iter.second.listener = invalid_socket;
+							}
+						}
+					}
+					m_tcp_table.erase(s);
+					m_counters.sockets_closed.add();
+					CXHandle(tcp_handle).Close();
+					return true;
+				}
+				return false;
+			}
+			virtual uv_tcp_t* QueryTcpSocket(uv_os_sock_t s) override
+			{
+				if (TCPCONTEXT* ctx = QueryTcpContext(s))
+				{
+					return ctx->handle;
+				}
+				return nullptr;
+			}
+			virtual TCPCONTEXT* QueryTcpContext(uv_os_sock_t s) override
+			{
+				auto tcp_iter = m_tcp_table.find(s);
+				if (tcp_iter != m_tcp_table.end())
+				{
+					return &tcp_iter->second;
+				}
+				return nullptr;
+			}
+		public: // poll register
+			virtual uv_poll_t* QueryPollHandle(uv_os_sock_t s, bool create, int* errcode = nullptr) override
+			{
+				auto poll_iter = m_poll_table.find(s);
+				if (poll_iter != m_poll_table.end())
+				{
+					return poll_iter->second;
+				}
+				if (create)
+				{
+					CXHandle Handle;
+					// a bad socket or one bound to another completion port
+					int result = CXHandle::OpenPoll(GetLoopContext(), s, Handle);
+
+					if (result == 0)
+					{
+						poll_entry* entry = MemAlloc<poll_entry>(sizeof(poll_entry));
+
+						entry->handle = Handle;
+						Handle.SetExclude(entry);
+						m_poll_table[s] = Handle;
+						return Handle;
+					}
+					if (errcode != nullptr)
+					{
+						*errcode = result;
+					}
+				}
+				return nullptr;
+			}
+			virtual bool ClosePollHandle(uv_os_sock_t s) override
+			{
+				if (uv_poll_t* poll_handle = QueryPollHandle(s, false))
+				{
+					CXHandle Handle(poll_handle);
+					poll_entry* entry = Handle.GetExclude<poll_entry>();
+
+					// parked tasks get UV_ECANCELED, their own timer brings them back
+					for (poll_waiter* waiter : { entry->reader, entry->writer })
+					{
+						if (waiter != nullptr)
+						{
+							waiter->result = UV_ECANCELED;
+							waiter->task->StartTimer(0);
+						}
+					}
+					m_poll_table.erase(s);
+					Handle.Close();
+					return true;
+				}
+				return false;
+			}
+		protected: // resolver cache
+			enum { dns_cache_ttl = 60 * 1000, dns_negative_ttl = 1000, dns_cache_limit = 1024 };
+
+			// gets the result itself, the entry may be pruned before the task runs
+			struct dns_waiter { IXTask* task; dns_waiter* next; int status; struct sockaddr_storage addr; };
+			struct dns_entry
+			{
+				bool pending;
+				int status;
+				std::uint64_t expire;
+				struct sockaddr_storage addr;
+				dns_waiter* waiters;
+			};
+			struct uv_dns_ext : uv_getaddrinfo_t { dns_entry* entry; };
+
+			// expired names go first, when the cache is still full every settled one
+			// does. lookups in flight stay, their callback holds the entry
+			void PruneDns()
+			{
+				std::uint64_t now = uv_now(GetLoopContext());
+
+				for (int pass = 0; (pass < 2) && (m_dns_cache.size() >= dns_cache_limit); pass++)
+				{
+					for (auto iter = m_dns_cache.begin(); iter != m_dns_cache.end(); )
+					{
+						if (!iter->second.pending && ((pass > 0) || (iter->second.expire <= now)))
+						{
+							iter = m_dns_cache.erase(iter);
+						}
+						else
+						{
+							iter++;
+						}
+					}
+				}
+			}
+		public: // resolver
+			virtual int ResolveHost(IXTask* task, const char* host, int af, struct sockaddr_storage* addr) override
+			{
+				std::string key(host);
+				key.append(1, '/').append(std::to_string(af));
+
+				auto found = m_dns_cache.find(key);
+				if (found == m_dns_cache.end())
+				{
+					if (m_dns_cache.size() >= dns_cache_limit)
+					{
+						PruneDns();
+					}
+					found = m_dns_cache.emplace(key, dns_entry()).first;
+				}
+
+				dns_entry& entry = found->second;
+				if (!entry.pending && (entry.expire <= uv_now(GetLoopContext())))
+				{
+					struct addrinfo hints;
+					uv_dns_ext* reqx = MemAlloc<uv_dns_ext>(sizeof(uv_dns_ext));
+
+					memset(&hints, 0x00, sizeof(hints));
+					hints.ai_family = af;
+					hints.ai_socktype = SOCK_STREAM;
+					hints.ai_protocol = IPPROTO_TCP;
+					reqx->entry = &entry;
+					int errcode = uv_getaddrinfo(GetLoopContext(), reqx, [](uv_getaddrinfo_t* req, int status, struct addrinfo* res) {
+						uv_dns_ext* reqx = (uv_dns_ext*)req;
+						dns_entry* entry = reqx->entry;
+						dns_waiter* waiter = entry->waiters;
+
+						if ((status == 0) && (res != nullptr))
+						{
+							memcpy(&entry->addr, res->ai_addr, res->ai_addrlen);
+						}
+						else if (status == 0)
+						{
+							status = UV_EAI_NONAME;
+						}
+						entry->status = status;
+						entry->expire = uv_now(req->loop) + ((status == 0) ? dns_cache_ttl : dns_negative_ttl);
+						entry->pending = false;
+						entry->waiters = nullptr;
+						uv_freeaddrinfo(res);
+						MemFree(reqx);
+
+						// every task asked for this name while the lookup was in flight
+						while (waiter != nullptr)
+						{
+							dns_waiter* next = waiter->next;
+
+							waiter->status = entry->status;
+							waiter->addr = entry->addr;
+							waiter->task->Resume();
+							waiter = next;
+						}
+					}, host, nullptr, &hints);
+					if (errcode != 0)
+					{
+						MemFree(reqx);
+						return errcode;
+					}
+					entry.pending = true;
+				}
+				if (entry.pending)
+				{
+					dns_waiter waiter = { task, entry.waiters, 0 };
+
+					entry.waiters = &waiter;
+					task->SuspendBlocked(blocked_io);
+					if (waiter.status == 0)
+					{
+						*addr = waiter.addr;
+					}
+					return waiter.status;
+				}
+				if (entry.status == 0)
+				{
+					*addr = entry.addr;
+				}
+				return entry.status;
+			}
+		protected: // connection pool
+			enum { pool_default_limit = 8 };
+
+			struct pool_waiter { IXTask* task; uv_os_sock_t sock; pool_waiter* next; };
+			struct pool_host
+			{
+				int total; // idle + busy + connecting
+				std::vector<uv_os_sock_t> idle;
+				pool_waiter* head;
+				pool_waiter* tail;
+			};
+			static std::string PoolKey(const struct sockaddr* name)
+			{
+				std::string key;
+
+				// sin_zero and friends are not part of the destination
+				if (name->sa_family == AF_INET6)
+				{
+					auto* addr6 = (const struct sockaddr_in6*)name;
+
+					key.append((const char*)&addr6->sin6_port, sizeof(addr6->sin6_port));
+					key.append((const char*)&addr6->sin6_addr, sizeof(addr6->sin6_addr));
+					key.append((const char*)&addr6->sin6_scope_id, sizeof(addr6->sin6_scope_id));
+				}
+				else
+				{
+					auto* addr4 = (const struct sockaddr_in*)name;
+
+					key.append((const char*)&addr4->sin_port, sizeof(addr4->sin_port));
+					key.append((const char*)&addr4->sin_addr, sizeof(addr4->sin_addr));
+				}
+				return key;
+			}
+			static bool IsAlive(uv_os_sock_t s)
+			{
+				char c;
+
+				// an idle keep-alive socket must have nothing to read: data means
+				// a desynced protocol, zero means the peer has closed it
+				int n = RawWinsock().recv(s, &c, 1, MSG_PEEK);
+				return (n < 0) && (WSAGetLastError() == WSAEWOULDBLOCK);
+			}
+			void PoolNotify(pool_host* host, uv_os_sock_t s)
+			{
+				if (pool_waiter* waiter = host->head)
+				{
+					if ((host->head = waiter->next) == nullptr)
+					{
+						host->tail = nullptr;
+					}
+					waiter->sock = s;
+					WakeupTask(waiter->task);
+				}
+				else if (s != invalid_socket)
+				{
+					host->idle.push_back(s);
+				}
+			}
+		public: // connection pool
+			virtual void SetPoolLimit(int max_per_host) override
+			{
+				m_pool_limit = (max_per_host > 0) ? max_per_host : 1;
+			}
+			virtual uv_os_sock_t PoolConnect(IXTask* task, const struct sockaddr* name, int namelen) override
+			{
+				pool_host& host = m_pool[PoolKey(name)];
+
+				while (true)
+				{
+					while (!host.idle.empty())
+					{
+						uv_os_sock_t s = host.idle.back();
+
+						host.idle.pop_back();
+						if (IsAlive(s))
+						{
+							m_pool_busy[s] = &host;
+							return s;
+						}
+						host.total--;
+						DetachTcpSocket(s);
+					}
+					if (host.total < m_pool_limit)
+					{
+						host.total++;
+						uv_os_sock_t s = CreateTcpSocket(name->sa_family);
+
+						if (s != invalid_socket)
+						{
+							if (task->connect(s, name, namelen) == 0)
+							{
+								m_pool_busy[s] = &host;
+								return s;
+							}
+							DetachTcpSocket(s);
+						}
+						host.total--;
+						PoolNotify(&host, invalid_socket);
+						return invalid_socket;
+					}
+
+					// all connections to this destination are busy, queue up
+					pool_waiter waiter = { task, invalid_socket, nullptr };
+
+					if (host.tail != nullptr)
+					{
+						host.tail->next = &waiter;
+					}
+					else
+					{
+						host.head = &waiter;
+					}
+					host.tail = &waiter;
+					task->SuspendBlocked(blocked_sync);
+					if (waiter.sock != invalid_socket)
+					{
+						m_pool_busy[waiter.sock] = &host;
+						return waiter.sock;
+					}
+				}
+			}
+			virtual int PoolRelease(uv_os_sock_t s, bool reuse) override
+			{
+				auto busy_iter = m_pool_busy.find(s);
+
+				if (busy_iter == m_pool_busy.end())
+				{
+					return -1;
+				}
+
+				pool_host* host = busy_iter->second;
+
+				m_pool_busy.erase(busy_iter);
+				if (!reuse)
+				{
+					host->total--;
+					DetachTcpSocket(s);
+					s = invalid_socket;
+				}
+				// a waiter takes the socket over, or gets the freed slot
+				PoolNotify(host, s);
+				return 0;
+			}
+		protected: // io buffers
+			enum { buffer_pool_limit = 256 }; // 16MB kept at most
+		public: // io buffers
+			virtual char* AllocBuffer() override
+			{
+				if (m_buffers.empty())
+				{
+					return MemAlloc<char>(io_buffer_size);
+				}
+
+				char* buffer = m_buffers.back();
+				m_buffers.pop_back();
+				return buffer;
+			}
+			virtual void FreeBuffer(char* buffer) override
+			{
+				if (m_buffers.size() < buffer_pool_limit)
+				{
+					m_buffers.push_back(buffer);
+				}
+				else
+				{
+					MemFree(buffer);
+				}
+			}
+		protected: // write queue
+			struct uv_queued_write_ext : uv_write_t { uv_os_sock_t sock; std::size_t size; };
+			struct write_waiter { IXTask* task; uv_stream_t* stream; std::size_t low; bool global; const int* pending; write_waiter* next; bool woken; };
+
+			bool BelowLow(const write_waiter* waiter) const
+			{
+				// a write the kernel took at once still has its callback to come
+				if ((waiter->pending != nullptr) && (*waiter->pending > 0))
+				{
+					return false;
+				}
+				if (waiter->stream->write_queue_size > waiter->low)
+				{
+					return false;
+				}
+				return !waiter->global || (m_write_high == 0) || (m_write_queued <= m_write_low);
+			}
+			void WriteDone(uv_queued_write_ext* reqx, int status)
+			{
+				TCPCONTEXT* ctx = QueryTcpContext(reqx->sock);
+
+				m_write_queued -= reqx->size;
+				// the number may belong to a new socket by now
+				if ((ctx != nullptr) && ((uv_stream_t*)ctx->handle == reqx->handle))
+				{
+					ctx->writes_pending--;
+					if ((status < 0) && (status != UV_ECANCELED) && (ctx->write_error == 0))
+					{
+						ctx->write_error = status;
+					}
+				}
+				// a failed stream will not drain, its waiters leave with the error
+				for (write_waiter** link = &m_write_waiters; *link != nullptr; )
+				{
+					write_waiter* waiter = *link;
+
+					if (BelowLow(waiter) || ((status < 0) && (waiter->stream == reqx->handle)))
+					{
+						*link = waiter->next;
+						waiter->woken = true;
+						WakeupTask(waiter->task);
+					}
+					else
+					{
+						link = &waiter->next;
+					}
+				}
+			}
+			void RemoveWriteWaiter(write_waiter* waiter)
+			{
+				for (write_waiter** link = &m_write_waiters; *link != nullptr; link = &(*link)->next)
+				{
+					if (*link == waiter)
+					{
+						*link = waiter->next;
+						break;
+					}
+				}
+			}
+			// 0, or UV_ECANCELED when the task was cancelled, what it queued still goes out
+			int WaitWrites(IXTask* task, uv_stream_t* stream, std::size_t low, bool global, const int* pending = nullptr)
+			{
+				write_waiter waiter = { task, stream, low, global, pending, m_write_waiters, false };
+
+				if (task->IsCancelled())
+				{
+					return UV_ECANCELED;
+				}
+				if (!BelowLow(&waiter))
+				{
+					m_write_waiters = &waiter;
+					task->SetCancelHook([](IXTask* task, void* arg) {
+						auto* scheduler = (CXScheduler*)task->GetXOwner();
+						auto* waiter = (write_waiter*)arg;
+
+						// a woken waiter is already in the ready queue
+						if (!waiter->woken)
+						{
+							scheduler->RemoveWriteWaiter(waiter);
+							scheduler->WakeupTask(task);
+						}
+					}, &waiter);
+					task->SuspendBlocked(blocked_io);
+					task->SetCancelHook(nullptr, nullptr);
+				}
+				return task->IsCancelled() ? UV_ECANCELED : 0;
+			}
+		public: // write queue
+			virtual void SetWriteLimit(std::size_t high, std::size_t low) override
+			{
+				m_write_high = high;
+				m_write_low = (low < high) ? low : high / 2;
+			}
+			virtual std::size_t QueuedBytes(uv_os_sock_t s) override
+			{
+				if (s == (uv_os_sock_t)invalid_socket)
+				{
+					return m_write_queued;
+				}
+				if (uv_tcp_t* tcp_handle = QueryTcpSocket(s))
+				{
+					return tcp_handle->write_queue_size;
+				}
+				return 0;
+			}
+			// the data is copied and the task goes on, it only waits once the
+			// socket or the whole scheduler is over its high mark
+			virtual int QueueWrite(IXTask* task, uv_os_sock_t s, const uv_buf_t bufs[], unsigned int nbufs) override
+			{
+				TCPCONTEXT* ctx = QueryTcpContext(s);
+
+				if (ctx == nullptr)
+				{
+					return -1;
+				}
+				if (ctx->write_error != 0)
+				{
+					return ctx->write_error;
+				}
+
+				uv_stream_t* stream = (uv_stream_t*)ctx->handle;
+				std::size_t size = 0;
+				int written = 0;
+
+				for (unsigned int i = 0; i < nbufs; i++)
+				{
+					size += bufs[i].len;
+				}
+				if (stream->write_queue_size == 0)
+				{
+					written = uv_try_write(stream, bufs, nbufs);
+					if ((written < 0) && (written != UV_EAGAIN) && (written != UV_ENOSYS))
+					{
+						return written;
+					}
+					written = (written > 0) ? written : 0;
+				}
+				if ((std::size_t)written < size)
+				{
+					auto* reqx = MemAlloc<uv_queued_write_ext>(sizeof(uv_queued_write_ext) + size - written);
+					char* data = (char*)(reqx + 1);
+					uv_buf_t uvbuf = uv_buf_init(data, (unsigned int)(size - written));
+
+					for (unsigned int i = 0; i < nbufs; i++)
+					{
+						std::size_t skip = ((std::size_t)written < bufs[i].len) ? written : bufs[i].len;
+
+						memcpy(data, bufs[i].base + skip, bufs[i].len - skip);
+						data += bufs[i].len - skip;
+						written -= (int)skip;
+					}
+					reqx->sock = s;
+					reqx->size = uvbuf.len;
+					int errcode = uv_write(reqx, stream, &uvbuf, 1, [](uv_write_t* req, int status) {
+						auto* reqx = (uv_queued_write_ext*)req;
+						auto* scheduler = (CXScheduler*)(IXScheduler*)req->handle->loop->data;
+
+						scheduler->WriteDone(reqx, status);
+						MemFree(reqx);
+					});
+					if (errcode != 0)
+					{
+						MemFree(reqx);
+						return errcode;
+					}
+					m_write_queued += uvbuf.len;
+					ctx->writes_pending++;
+				}
+
+				std::size_t high = ctx->options.write_high;
+				std::size_t low = (ctx->options.write_low > 0) ? ctx->options.write_low : high / 2;
+				if ((stream->write_queue_size >= high) || ((m_write_high > 0) && (m_write_queued >= m_write_high)))
+				{
+					// the data is queued whole, a cancelled wait leaves the socket usable
+					if (WaitWrites(task, stream, low, true) != 0)
+					{
+						return UV_ECANCELED;
+					}
+				}
+				return ctx->write_error;
+			}
+			// everything queued reaches the kernel and is called back before the socket is closed
+			virtual int DrainWrites(IXTask* task, uv_os_sock_t s) override
+			{
+				TCPCONTEXT* ctx = QueryTcpContext(s);
+
+				if ((ctx == nullptr) || (ctx->write_error != 0))
+				{
+					return (ctx != nullptr) ? ctx->write_error : -1;
+				}
+				WaitWrites(task, (uv_stream_t*)ctx->handle, 0, false, &ctx->writes_pending);
+				return ctx->write_error;
+			}
+		protected: // loop timing
+			// windows runs io callbacks after this, in the next iteration, so the poll
+			// ends here. elsewhere they run inside the poll and the first one ends it
+			void LoopChecked()
+			{
+				std::uint64_t now = uv_hrtime();
+				std::uint64_t waited = (m_loop.polling ? now : m_loop.batch_start) - m_loop.prepared;
+
+				if (m_loop.checked != 0)
+				{
+					std::uint64_t iteration = now - m_loop.checked;
+
+					m_loop.timing[loop_iteration].record(iteration - (std::min)(iteration, waited));
+				}
+				m_loop.checked = m_loop.batch_start = now;
+				m_loop.polling = false;
+			}
+			static void DumpHistogram(std::string& out, const char* name, const Histogram& histogram)
+			{
+				char line[256];
+
+				snprintf(line, sizeof(line), "%-22s n=%llu mean=%.1f p50=%.1f p90=%.1f p99=%.1f p99.9=%.1f max=%.1f\n", name,
+					(unsigned long long)histogram.count(), histogram.mean() / 1000,
+					histogram.percentile(50) / 1000.0, histogram.percentile(90) / 1000.0,
+					histogram.percentile(99) / 1000.0, histogram.percentile(99.9) / 1000.0, histogram.max() / 1000.0);
+				out += line;
+			}
+		public: // loop timing
+			virtual const Histogram& LoopTiming(LoopMetric metric) override
+			{
+				assert((metric >= 0) && (metric < loop_metrics));
+				return m_loop.timing[metric];
+			}
+			virtual void ResetTiming() override
+			{
+				for (Histogram& histogram : m_loop.timing)
+				{
+					histogram.reset();
+				}
+				for (Histogram& histogram : m_ready_latency)
+				{
+					histogram.reset();
+				}
+			}
+			virtual std::string DumpTiming() override
+			{
+				static const char* ready_names[priority_classes] = { "ready interactive", "ready normal", "ready background" };
+				std::string out;
+
+				DumpHistogram(out, "loop iteration", m_loop.timing[loop_iteration]);
+				DumpHistogram(out, "callback to resume", m_loop.timing[loop_wakeup]);
+				DumpHistogram(out, "run slice", m_loop.timing[loop_slice]);
+				for (int i = 0; i < priority_classes; i++)
+				{
+					DumpHistogram(out, ready_names[i], m_ready_latency[i]);
+				}
+				return out;
+			}
+		protected: // watchdog
+			enum { watch_stack_copy = 64 * 1024 }; // innermost bytes of the stack that are walked
+			void StopWatchdog()
+			{
+				if (!m_watch_running)
+				{
+					return;
+				}
+				uv_mutex_lock(&m_watch_mutex);
+				m_watch_stop = true;
+				uv_cond_signal(&m_watch_cond);
+				uv_mutex_unlock(&m_watch_mutex);
+				uv_thread_join(&m_watch_thread);
+				m_watch_running = false;
+				m_watch.armed = false;
+				m_watch.preempt = false;
+#if defined(_MSC_VER)
+				CloseHandle(m_watched_thread);
+#endif
+			}
+			// runs on the watchdog thread, checks four times per threshold
+			void Watch()
+			{
+				std::uint64_t reported = 0;
+
+				uv_mutex_lock(&m_watch_mutex);
+				while (!m_watch_stop)
+				{
+					uv_cond_timedwait(&m_watch_cond, &m_watch_mutex, m_watch_threshold / 4);
+					std::uint64_t since = m_watch.since.load(std::memory_order_acquire);
+					IXTask* task = m_watch.task.load(std::memory_order_relaxed);
+					std::uint64_t now = uv_hrtime();
+
+					// reported already, or the loop has it back
+					if ((since == 0) || (since == reported) || (now - since < m_watch_threshold))
+					{
+						continue;
+					}
+					HogReport report;
+
+					report.task = task;
+					report.running_ms = (now - since) / 1000000;
+					report.frames = CaptureStack(report.stack, HogReport::max_frames);
+					// the stack is only the task's if it still runs
+					if (m_watch.since.load(std::memory_order_acquire) != since)
+					{
+						continue;
+					}
+					reported = since;
+					if (m_watch_preempt)
+					{
+						m_watch.preempt.store(true, std::memory_order_relaxed);
+					}
+					if (m_watch_handler)
+					{
+						m_watch_handler(report);
+					}
+				}
+				uv_mutex_unlock(&m_watch_mutex);
+			}
+			// return addresses of the scheduler thread. it is suspended only to read its
+			// registers and copy its stack, the unwinder may take loader locks the
+			// thread holds, so it runs on the copy once the thread goes on
+			int CaptureStack(void** stack, int max_frames)
+			{
+				int frames = 0;
+#if defined(_MSC_VER)
+				CONTEXT context;
+
+				memset(&context, 0x00, sizeof(context));
+				context.ContextFlags = CONTEXT_CONTROL | CONTEXT_INTEGER;
+				if (SuspendThread(m_watched_thread) == (DWORD)-1)
+				{
+					return 0;
+				}
+				if (!GetThreadContext(m_watched_thread, &context))
+				{
+					ResumeThread(m_watched_thread);
+					return 0;
+				}
+#if defined(_M_X64)
+				MEMORY_BASIC_INFORMATION region;
+				DWORD64 low = context.Rsp, high = low;
+
+				// the used part of the fiber stack is one committed region up to its base
+				if (VirtualQuery((LPCVOID)low, &region, sizeof(region)) == sizeof(region))
+				{
+					high = (std::min)((DWORD64)region.BaseAddress + region.RegionSize, low + m_watch_stack.size());
+					memcpy(m_watch_stack.data(), (const void*)low, (std::size_t)(high - low));
+				}
+				ResumeThread(m_watched_thread);
+
+				// pointers into the stack now point into the copy
+				DWORD64 copy_low = (DWORD64)m_watch_stack.data();
+				DWORD64 copy_high = copy_low + (high - low);
+				auto rebase = [&](DWORD64& value) {
+					if ((value >= low) && (value < high))
+					{
+						value += copy_low - low;
+					}
+				};
+				DWORD64* registers[] = { &context.Rsp, &context.Rbp, &context.Rbx, &context.Rsi, &context.Rdi,
+					&context.R12, &context.R13, &context.R14, &context.R15 };
+				for (DWORD64* value : registers)
+				{
+					rebase(*value);
+				}
+				for (DWORD64 slot = copy_low; slot + sizeof(DWORD64) <= copy_high; slot += sizeof(DWORD64))
+				{
+					rebase(*(DWORD64*)slot);
+				}
+				while ((frames < max_frames) && (context.Rip != 0))
+				{
+					DWORD64 image_base;
+					PVOID handler_data;
+					DWORD64 establisher_frame;
+
+					// a bad unwind leaves the copy, stop there
+					if ((context.Rsp < copy_low) || (context.Rsp >= copy_high))
+					{
+						break;
+					}
+					stack[frames++] = (void*)context.Rip;
+					PRUNTIME_FUNCTION function = RtlLookupFunctionEntry(context.Rip, &image_base, nullptr);
+					if (function == nullptr)
+					{
+						// leaf function, the return address is on top
+						if (context.Rsp + sizeof(DWORD64) > copy_high)
+						{
+							break;
+						}
+						context.Rip = *(DWORD64*)context.Rsp;
+						context.Rsp += sizeof(DWORD64);
+						continue;
+					}
+					RtlVirtualUnwind(UNW_FLAG_NHANDLER, image_base, context.Rip, function, &context, &handler_data, &establisher_frame, nullptr);
+				}
+#else
+				ResumeThread(m_watched_thread);
+#if defined(_M_ARM64)
+				stack[frames++] = (void*)context.Pc;
+#else
+				stack[frames++] = (void*)context.Eip;
+#endif
+#endif
+#endif
+				return frames;
+			}
+		public: // watchdog
+			virtual int SetWatchdog(std::uint64_t threshold_ms, bool preempt, std::function<void(const HogReport&)> handler) override
+			{
+				StopWatchdog();
+				if (threshold_ms == 0)
+				{
+					return 0;
+				}
+#if defined(_MSC_VER)
+				if (!DuplicateHandle(GetCurrentProcess(), GetCurrentThread(), GetCurrentProcess(), &m_watched_thread,
+					THREAD_SUSPEND_RESUME | THREAD_GET_CONTEXT, FALSE, 0))
+				{
+					return uv_translate_sys_error(GetLastError());
+				}
+#endif
+				m_watch_threshold = threshold_ms * 1000000;
+				m_watch_preempt = preempt;
+				// nothing may be allocated while the scheduler thread is suspended
+				m_watch_stack.resize(watch_stack_copy);
+				m_watch_handler = handler;
+				m_watch_stop = false;
+				m_watch.armed = true;
+				int errcode = uv_thread_create(&m_watch_thread, [](void* arg) {
+					((CXScheduler*)arg)->Watch();
+				}, this);
+				if (errcode != 0)
+				{
+					m_watch.armed = false;
+#if defined(_MSC_VER)
+					CloseHandle(m_watched_thread);
+#endif
+					return errcode;
+				}
+				m_watch_running = true;
+				return 0;
+			}
+		public: // statistics
+			virtual void GetStats(SchedulerStats& stats) override
+			{
+				stats.tasks_created = m_counters.tasks_created.get();
+				stats.tasks_finished = m_counters.tasks_finished.get();
+				stats.tasks_live = stats.tasks_created - (std::min)(stats.tasks_created, stats.tasks_finished);
+				stats.wakeups_ready = m_counters.wakeups_ready.get();
+				std::uint64_t queued = m_counters.ready_queued.get();
+				stats.tasks_ready = queued - (std::min)(queued, stats.wakeups_ready);
+				stats.switches = m_counters.switches.get();
+				stats.wakeups_remote = m_counters.wakeups_remote.get();
+				stats.wakeups_timer = m_counters.wakeups_timer.get();
+				// every other resume comes from a completion callback
+				std::uint64_t counted = stats.wakeups_ready + stats.wakeups_timer;
+				stats.wakeups_io = stats.switches - (std::min)(stats.switches, counted);
+				for (int i = 0; i < block_reasons; i++)
+				{
+					stats.blocked[i] = m_counters.blocked[i].get();
+				}
+				std::uint64_t opened = m_counters.sockets_opened.get();
+				stats.sockets = opened - (std::min)(opened, m_counters.sockets_closed.get());
+				stats.bytes_in = m_counters.bytes_in.get();
+				stats.bytes_out = m_counters.bytes_out.get();
+			}
+		protected: // overload protection
+			enum { overload_interval = 100 }; // ms between lag / memory samples
+			struct accept_waiter { IXTask* task; accept_waiter* next; };
+
+			bool AcceptAllowed(uv_os_sock_t s)
+			{
+				TCPCONTEXT* ctx = QueryTcpContext(s);
+
+				if ((ctx != nullptr) && (ctx->options.max_connections > 0) && (ctx->connections >= ctx->options.max_connections))
+				{
+					return false;
+				}
+				if ((m_task_limit > 0) && (m_task_count >= m_task_limit))
+				{
+					return false;
+				}
+				return !m_overloaded;
+			}
+			// every throttled listener checks its limits again
+			void NotifyAccept()
+			{
+				accept_waiter* waiter = m_accept_waiters;
+
+				m_accept_waiters = nullptr;
+				for (; waiter != nullptr; waiter = waiter->next)
+				{
+					WakeupTask(waiter->task);
+				}
+			}
+			// the timer fires late by as much as the loop lags
+			void SampleOverload()
+			{
+				std::uint64_t now = uv_hrtime();
+				std::uint64_t elapsed = (now - m_overload_tick) / 1000000;
+				std::uint64_t lag = (elapsed > overload_interval) ? elapsed - overload_interval : 0;
+				std::size_t rss = 0;
+
+				m_overload_tick = now;
+				if (m_max_rss > 0)
+				{
+					uv_resident_set_memory(&rss);
+				}
+				if (!m_overloaded)
+				{
+					m_overloaded = ((m_max_lag > 0) && (lag > m_max_lag)) || ((m_max_rss > 0) && (rss > m_max_rss));
+				}
+				else if (((m_max_lag == 0) || (lag <= m_max_lag / 2)) && ((m_max_rss == 0) || (rss <= m_max_rss / 10 * 9)))
+				{
+					m_overloaded = false;
+					NotifyAccept();
+				}
+			}
+		public: // overload protection
+			virtual void SetTaskLimit(int max_tasks) override
+			{
+				m_task_limit = (max_tasks > 0) ? max_tasks : 0;
+				NotifyAccept();
+			}
+			virtual void SetOverloadLimit(std::uint64_t max_lag_ms, std::size_t max_rss) override
+			{
+				m_max_lag = max_lag_ms;
+				m_max_rss = max_rss;
+				if ((m_max_lag == 0) && (m_max_rss == 0))
+				{
+					m_overloaded = false;
+					NotifyAccept();
+				}
+				else if (m_overload_timer == nullptr)
+				{
+					CXHandle Handle(GetLoopContext(), UV_TIMER);
+
+					m_overload_timer = Handle;
+					m_overload_tick = uv_hrtime();
+					uv_timer_start(m_overload_timer, [](uv_timer_t* handle) {
+						auto* scheduler = (CXScheduler*)(IXScheduler*)handle->loop->data;
+
+						scheduler->SampleOverload();
+					}, overload_interval, overload_interval);
+					// sampling alone does not keep the loop alive
+					uv_unref(Handle);
+				}
+			}
+			virtual bool IsOverloaded() override
+			{
+				return m_overloaded;
+			}
+			virtual void ThrottleAccept(IXTask* task, uv_os_sock_t s) override
+			{
+				while (!AcceptAllowed(s))
+				{
+					accept_waiter waiter = { task, m_accept_waiters };
+
+					m_accept_waiters = &waiter;
+					task->SuspendBlocked(blocked_io);
+				}
+			}
+		protected: // run_blocking slots
+			struct work_waiter { IXTask* task; work_waiter* next; bool granted; };
+
+			// a freed slot goes to the first waiter, nobody can barge in
+			void GrantWorkers()
+			{
+				while ((m_work_head != nullptr) && ((m_work_limit <= 0) || (m_work_running < m_work_limit)))
+				{
+					work_waiter* waiter = m_work_head;
+
+					if ((m_work_head = waiter->next) == nullptr)
+					{
+						m_work_tail = nullptr;
+					}
+					m_work_running++;
+					waiter->granted = true;
+					WakeupTask(waiter->task);
+				}
+			}
+			void RemoveWorkWaiter(work_waiter* waiter)
+			{
+				work_waiter* prev = nullptr;
+
+				for (work_waiter* node = m_work_head; node != nullptr; prev = node, node = node->next)
+				{
+					if (node == waiter)
+					{
+						if (prev != nullptr)
+						{
+							prev->next = node->next;
+						}
+						else
+						{
+							m_work_head = node->next;
+						}
+						if (m_work_tail == node)
+						{
+							m_work_tail = prev;
+						}
+						break;
+					}
+				}
+			}
+		public:
+			virtual void SetBlockingLimit(int max_running) override
+			{
+				m_work_limit = max_running;
+				GrantWorkers();
+			}
+			virtual bool AcquireWorker(IXTask* task) override
+			{
+				if ((m_work_head == nullptr) && ((m_work_limit <= 0) || (m_work_running < m_work_limit)))
+				{
+					m_work_running++;
+					return true;
+				}
+				work_waiter waiter = { task, nullptr, false };
+
+				if (m_work_tail != nullptr)
+				{
+					m_work_tail->next = &waiter;
+				}
+				else
+				{
+					m_work_head = &waiter;
+				}
+				m_work_tail = &waiter;
+				task->SetCancelHook([](IXTask* task, void* arg) {
+					auto* scheduler = (CXScheduler*)task->GetXOwner();
+					auto* waiter = (work_waiter*)arg;
+
+					// a granted waiter is already in the ready queue
+					if (!waiter->granted)
+					{
+						scheduler->RemoveWorkWaiter(waiter);
+						scheduler->WakeupTask(task);
+					}
+				}, &waiter);
+				task->SuspendBlocked(blocked_pool);
+				task->SetCancelHook(nullptr, nullptr);
+				return waiter.granted;
+			}
+			virtual void ReleaseWorker() override
+			{
+				m_work_running--;
+				GrantWorkers();
+			}
+		private:
+			FIBER_T m_fiber;
+			bool m_was_converted;
+			uv_loop_t* m_loop_context;
+
+			std::unordered_map<uv_os_sock_t, TCPCONTEXT> m_tcp_table;
+			std::unordered_map<uv_os_sock_t, uv_poll_t*> m_poll_table;
+			std::unordered_map<std::string, dns_entry> m_dns_cache;
+
+			int m_pool_limit;
+			std::unordered_map<std::string, pool_host> m_pool;
+			std::unordered_map<uv_os_sock_t, pool_host*> m_pool_busy;
+
+			std::vector<char*> m_buffers;
+
+			std::size_t m_write_high;
+			std::size_t m_write_low;
+			std::size_t m_write_queued;
+			write_waiter* m_write_waiters;
+
+			int m_task_count;
+			int m_task_limit;
+			std::uint64_t m_max_lag;
+			std::size_t m_max_rss;
+			bool m_overloaded;
+			uv_timer_t* m_overload_timer;
+			std::uint64_t m_overload_tick;
+			accept_waiter* m_accept_waiters;
+
+			int m_work_limit;
+			int m_work_running;
+			work_waiter* m_work_head;
+			work_waiter* m_work_tail;
+
+			uv_idle_t* m_ready_idle;
+			IXTask* m_ready_head[priority_classes];
+			IXTask* m_ready_tail[priority_classes];
+			int m_ready_count[priority_classes];
+			Histogram m_ready_latency[priority_classes];
+
+			uv_async_t* m_remote_async;
+			std::atomic<IXTask*> m_remote_head;
+			int m_remote_waiting;
+
+			scheduler_counters m_counters;
+			loop_state m_loop;
+			uv_prepare_t* m_loop_prepare;
+			uv_check_t* m_loop_check;
+
+			watch_state m_watch;
+			std::uint64_t m_watch_threshold; // ns
+			bool m_watch_preempt;
+			bool m_watch_stop;
+			bool m_watch_running;
+			std::function<void(const HogReport&)> m_watch_handler;
+			std::vector<char> m_watch_stack; // copy of the suspended stack
+			uv_thread_t m_watch_thread;
+			uv_mutex_t m_watch_mutex;
+			uv_cond_t m_watch_cond;
+#if defined(_MSC_VER)
+			HANDLE m_watched_thread; // the scheduler thread, suspended to walk its stack
+#endif
+		};
+		inline unsigned int CountTrailingZeros(std::uint64_t mask)
+		{
+#if defined(_MSC_VER)
+			unsigned long index;
+#if defined(_M_X64) || defined(_M_ARM64)
+			_BitScanForward64(&index, mask);
+#else
+			if (!_BitScanForward(&index, (unsigned long)mask))
+			{
+				_BitScanForward(&index, (unsigned long)(mask >> 32));
+				index += 32;
+			}
+#endif
+			return index;
+#else
+			return __builtin_ctzll(mask);
+#endif
+		}
+
+		// first c in [p, end) or nullptr, 16/32 bytes per step
+		inline const char* FindByte(const char* p, const char* end, char c)
+		{
+#if defined(__AVX2__)
+			const __m256i needle = _mm256_set1_epi8(c);
+			for (; end - p >= 32; p += 32)
+			{
+				__m256i chunk = _mm256_loadu_si256((const __m256i*)p);
+				unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle));
+
+				if (mask != 0)
+				{
+					return p + CountTrailingZeros(mask);
+				}
+			}
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+			const __m128i needle = _mm_set1_epi8(c);
+			for (; end - p >= 16; p += 16)
+			{
+				__m128i chunk = _mm_loadu_si128((const __m128i*)p);
+				unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+
+				if (mask != 0)
+				{
+					return p + CountTrailingZeros(mask);
+				}
+			}
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+			const uint8x16_t needle = vdupq_n_u8((uint8_t)c);
+			for (; end - p >= 16; p += 16)
+			{
+				uint8x16_t eq = vceqq_u8(vld1q_u8((const uint8_t*)p), needle);
+				// narrow every byte of the compare to a nibble
+				std::uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+
+				if (mask != 0)
+				{
+					return p + (CountTrailingZeros(mask) >> 2);
+				}
+			}
+#endif
+			for (; p < end; p++)
+			{
+				if (*p == c)
+				{
+					return p;
+				}
+			}
+			return nullptr;
+		}
+	} // namespace impl
+
+	// read-ahead buffer over ITask::recv for one socket
+	//
+	// views handed out by read_until/read_frame point into the buffer and
+	// stay valid until the next call, the buffer is reused for every message
+	// and never grows: a message larger than the capacity gets UV_ENOBUFS.
+	// every call returns the message length or a uv error (UV_EOF if the
+	// peer closed before the message was complete).
+	class StreamReader
+	{
+	public:
+		StreamReader(ITask* task, uv_os_sock_t s, int capacity = 16 * 1024)
+			: m_task(task), m_sock(s), m_capacity(capacity), m_begin(0), m_end(0)
+		{
+			m_buffer = impl::MemAlloc<char>(capacity);
+		}
+		~StreamReader()
+		{
+			impl::MemFree(m_buffer);
+		}
+		StreamReader(const StreamReader&) = delete;
+		StreamReader& operator=(const StreamReader&) = delete;
+	public:
+		int buffered() const { return m_end - m_begin; }
+		int capacity() const { return m_capacity; }
+		// n bytes copied into buf, large reads bypass the buffer
+		int read_exact(char* buf, int n)
+		{
+			int got = (buffered() < n) ? buffered() : n;
+
+			memcpy(buf, m_buffer + m_begin, got);
+			m_begin += got;
+			while (got < n)
+			{
+				int nread = (n - got >= m_capacity) ? m_task->recv(m_sock, buf + got, n - got) : Fill();
+
+				if (nread <= 0)
+				{
+					return (nread == 0) ? UV_EOF : nread;
+				}
+				if (n - got >= m_capacity)
+				{
+					got += nread;
+				}
+				else
+				{
+					int take = (buffered() < n - got) ? buffered() : n - got;
+
+					memcpy(buf + got, m_buffer + m_begin, take);
+					m_begin += take;
+					got += take;
+				}
+			}
+			return n;
+		}
+		// up to and including delim
+		int read_until(char delim, const char** data)
+		{
+			return read_until(&delim, 1, data);
+		}
+		int read_until(const char* delim, int len, const char** data)
+		{
+			int n = peek_until(delim, len, data);
+
+			if (n > 0)
+			{
+				m_begin += n;
+			}
+			return n;
+		}
+		// same as read_until, the bytes stay in the buffer until consume
+		int peek_until(const char* delim, int len, const char** data)
+		{
+			int scanned = 0; // what was already searched is not searched again
+
+			while (true)
+			{
+				const char* base = m_buffer + m_begin;
+				const char* end = m_buffer + m_end;
+				const char* p = base + scanned;
+
+				while ((p = impl::FindByte(p, end, delim[0])) != nullptr)
+				{
+					if (end - p < len)
+					{
+						break;
+					}
+					if (memcmp(p, delim, len) == 0)
+					{
+						*data = base;
+						return (int)(p - base) + len;
+					}
+					p++;
+				}
+				scanned = (buffered() >= len) ? buffered() - len + 1 : 0;
+
+				int nread = Fill();
+				if (nread <= 0)
+				{
+					return (nread == 0) ? UV_EOF : nread;
+				}
+			}
+		}
+		// first n bytes without consuming them, earlier views may move
+		int peek(int n, const char** data)
+		{
+			if ((n = Require(n)) > 0)
+			{
+				*data = m_buffer + m_begin;
+			}
+			return n;
+		}
+		void consume(int n)
+		{
+			assert(n <= buffered());
+			m_begin += n;
+		}
+		// big-endian length prefix of 1, 2 or 4 bytes, then the payload
+		int read_frame(const char** data, int prefix = 4)
+		{
+			int n = Require(prefix);
+
+			if (n < 0)
+			{
+				return n;
+			}
+
+			std::uint32_t length = 0;
+			for (int i = 0; i < prefix; i++)
+			{
+				length = (length << 8) | (unsigned char)m_buffer[m_begin + i];
+			}
+			if (length > (std::uint32_t)(m_capacity - prefix))
+			{
+				return UV_ENOBUFS;
+			}
+			if ((n = Require(prefix + (int)length)) < 0)
+			{
+				return n;
+			}
+			*data = m_buffer + m_begin + prefix;
+			m_begin += prefix + (int)length;
+			return (int)length;
+		}
+	protected:
+		// one recv into the free tail, compacting first when the tail is short
+		int Fill()
+		{
+			if (m_begin == m_end)
+			{
+				m_begin = m_end = 0;
+			}
+			else if ((m_end == m_capacity) || (m_begin > m_capacity / 2))
+			{
+				memmove(m_buffer, m_buffer + m_begin, m_end - m_begin);
+				m_end -= m_begin;
+				m_begin = 0;
+			}
+			if (m_end == m_capacity)
+			{
+				return UV_ENOBUFS;
+			}
+
+			int nread = m_task->recv(m_sock, m_buffer + m_end, m_capacity - m_end);
+			if (nread > 0)
+			{
+				m_end += nread;
+			}
+			return nread;
+		}
+		int Require(int n)
+		{
+			if (n > m_capacity)
+			{
+				return UV_ENOBUFS;
+			}
+			while (buffered() < n)
+			{
+				int nread = Fill();
+
+				if (nread <= 0)
+				{
+					return (nread == 0) ? UV_EOF : nread;
+				}
+			}
+			return n;
+		}
+	private:
+		ITask* m_task;
+		uv_os_sock_t m_sock;
+		char* m_buffer;
+		int m_capacity;
+		int m_begin;
+		int m_end;
+	};
+
+	IScheduler* CreateScheduler() { return impl::CXScheduler::Create(); }
+
+	inline TaskHandle::TaskHandle(impl::IXTask* task) : m_task(task)
+	{
+		if (m_task != nullptr)
+		{
+			m_task->AddRef();
+		}
+	}
+	inline TaskHandle::TaskHandle(const TaskHandle& other) : m_task(other.m_task)
+	{
+		if (m_task != nullptr)
+		{
+			m_task->AddRef();
+		}
+	}
+	inline TaskHandle::~TaskHandle()
+	{
+		if (m_task != nullptr)
+		{
+			m_task->Release();
+		}
+	}
+	inline ITask* TaskHandle::get() const { return m_task; }
+	inline bool TaskHandle::done() const { return (m_task == nullptr) || m_task->IsFinished(); }
+	inline int TaskHandle::join(ITask* task)
+	{
+		if (m_task == nullptr)
+		{
+			return -1;
+		}
+		if (!m_task->IsFinished())
+		{
+			impl::IXTask* xtask = static_cast<impl::IXTask*>(task);
+			bool fired = false;
+			impl::join_waiter waiter = { xtask, nullptr, &fired };
+
+			assert(xtask != m_task);
+			m_task->AddJoiner(&waiter);
+			xtask->SuspendBlocked(blocked_join);
+		}
+		return m_task->IsCancelled() ? UV_ECANCELED : 0;
+	}
+	inline void TaskHandle::cancel()
+	{
+		if (m_task != nullptr)
+		{
+			m_task->Cancel();
+		}
+	}
+	inline int WhenAll(ITask* task, TaskHandle* handles, int count)
+	{
+		int status = 0;
+
+		for (int i = 0; i < count; i++)
+		{
+			if (handles[i].join(task) == UV_ECANCELED)
+			{
+				status = UV_ECANCELED;
+			}
+		}
+		return status;
+	}
+	inline int WhenAny(ITask* task, TaskHandle* handles, int count)
+	{
+		int valid = 0;
+
+		for (int i = 0; i < count; i++)
+		{
+			if (handles[i])
+			{
+				if (handles[i].done())
+				{
+					return i;
+				}
+				valid++;
+			}
+		}
+		if (valid == 0)
+		{
+			return -1;
+		}
+		// one waiter on every task, the first to finish wakes us
+		impl::IXTask* xtask = static_cast<impl::IXTask*>(task);
+		impl::join_waiter stack_waiters[16];
+		impl::join_waiter* waiters = stack_waiters;
+		bool fired = false;
+		int index = -1;
+
+		if (count > (int)_countof(stack_waiters))
+		{
+			waiters = impl::MemAlloc<impl::join_waiter>(count * sizeof(impl::join_waiter));
+		}
+		for (int i = 0; i < count; i++)
+		{
+			if (handles[i])
+			{
+				waiters[i] = { xtask, nullptr, &fired };
+				handles[i].m_task->AddJoiner(&waiters[i]);
+			}
+		}
+		xtask->SuspendBlocked(blocked_join);
+		for (int i = 0; i < count; i++)
+		{
+			if (handles[i])
+			{
+				handles[i].m_task->RemoveJoiner(&waiters[i]);
+				if ((index < 0) && handles[i].done())
+				{
+					index = i;
+				}
+			}
+		}
+		if (waiters != stack_waiters)
+		{
+			impl::MemFree(waiters);
+		}
+		return index;
+	}
+
+	// child of a TaskGroup, 0 when it did its work or an error code
+	typedef std::function<int(ITask*)> GroupRoutine;
+
+	// owns the tasks spawned through it and waits for them when it goes out of
+	// scope, so no child outlives the code that started it
+	//
+	//   libco::TaskGroup group(8);            // at most 8 children at once
+	//   for (auto& backend : backends)
+	//       group.spawn([&](libco::ITask* task) { return query(task, backend); });
+	//   int status = group.wait();            // first error, 0 when all did fine
+	//
+	// the first child that fails cancels its siblings, and a task cancelled
+	// while it waits for the group cancels the children. spawn and wait
+	// suspend the calling task, tasks of one scheduler only
+	class TaskGroup
+	{
+	public:
+		explicit TaskGroup(int max_running = 0)
+			: m_limit(max_running), m_status(0), m_running(0), m_peak(0), m_spawned(0), m_failed(0), m_waiters(nullptr) { }
+		~TaskGroup() { wait(); }
+		TaskGroup(const TaskGroup&) = delete;
+		TaskGroup& operator=(const TaskGroup&) = delete;
+	public:
+		// waits while max_running children run, empty once the group failed
+		TaskHandle spawn(GroupRoutine routine)
+		{
+			impl::IXTask* caller = impl::CurrentTask();
+
+			assert(caller != nullptr);
+			while ((m_limit > 0) && (m_running >= m_limit) && (m_status == 0))
+			{
+				Block(caller);
+			}
+			if (m_status != 0)
+			{
+				return TaskHandle();
+			}
+			TaskHandle handle = caller->GetOwner()->NewTask([this, routine](ITask* task) {
+				Done(routine(task));
+			});
+			if (handle)
+			{
+				if (++m_running > m_peak)
+				{
+					m_peak = m_running;
+				}
+				m_spawned++;
+				Track(handle);
+			}
+			return handle;
+		}
+		// returns once no child runs, with the first error
+		int wait()
+		{
+			impl::IXTask* caller = impl::CurrentTask();
+
+			while (m_running > 0)
+			{
+				assert(caller != nullptr);
+				Block(caller);
+			}
+			m_handles.clear();
+			return m_status;
+		}
+		// children blocked in recv / send / Sleep return, no new ones start
+		void cancel()
+		{
+			if (m_status == 0)
+			{
+				m_status = UV_ECANCELED;
+			}
+			CancelAll();
+		}
+	public: // counters
+		int status() const { return m_status; }
+		int running() const { return m_running; }
+		int peak() const { return m_peak; } // most children running at once
+		std::uint64_t spawned() const { return m_spawned; }
+		std::uint64_t failed() const { return m_failed; }
+	protected:
+		void Done(int status)
+		{
+			m_running--;
+			if (status != 0)
+			{
+				m_failed++;
+				if (m_status == 0)
+				{
+					m_status = status;
+					CancelAll();
+				}
+			}
+			// spawn and wait look again
+			while (impl::join_waiter* waiter = m_waiters)
+			{
+				m_waiters = waiter->next;
+				waiter->task->GetXOwner()->WakeupTask(waiter->task);
+			}
+		}
+		void CancelAll()
+		{
+			ITask* current = impl::CurrentTask();
+
+			for (auto& handle : m_handles)
+			{
+				if (handle.get() != current)
+				{
+					handle.cancel();
+				}
+			}
+		}
+		// finished handles are dropped once they are half of the list
+		void Track(const TaskHandle& handle)
+		{
+			if (m_handles.size() >= 2 * (std::size_t)m_running + 16)
+			{
+				std::size_t kept = 0;
+
+				for (std::size_t i = 0; i < m_handles.size(); i++)
+				{
+					if (!m_handles[i].done())
+					{
+						std::swap(m_handles[kept++], m_handles[i]);
+					}
+				}
+				m_handles.resize(kept);
+			}
+			m_handles.push_back(handle);
+		}
+		void Block(impl::IXTask* task)
+		{
+			bool fired = false;
+			impl::join_waiter waiter = { task, m_waiters, &fired };
+
+			if (task->IsCancelled())
+			{
+				cancel();
+			}
+			m_waiters = &waiter;
+			task->SetCancelHook([](impl::IXTask* task, void* arg) {
+				((TaskGroup*)arg)->cancel();
+			}, this);
+			task->SuspendBlocked(blocked_join);
+			task->SetCancelHook(nullptr, nullptr);
+		}
+	private:
+		int m_limit;
+		int m_status;
+		int m_running;
+		int m_peak;
+		std::uint64_t m_spawned;
+		std::uint64_t m_failed;
+		std::vector<TaskHandle> m_handles;
+		impl::join_waiter* m_waiters;
+	};
+
+	inline ITask* GetCurrentTask() { return impl::CurrentTask(); }
+
+	// a value per task, found by a fixed index instead of a lookup
+	//
+	//   static libco::TaskLocal<std::string> trace_id(true);
+	//   trace_id.set("req-42");              // in the task handling the request
+	//   if (auto* id = trace_id.get()) ...   // anywhere below it, in child tasks too
+	//
+	// the value is destroyed when its task returns. inherit copies it into tasks
+	// created with NewTask while it is set. keep the object itself static, at
+	// most max_task_locals of them exist per process
+	template<typename T> class TaskLocal
+	{
+	public:
+		explicit TaskLocal(bool inherit = false) : m_index(impl::AllocLocalSlot(Destroy, inherit ? Copy : nullptr)) { }
+		TaskLocal(const TaskLocal&) = delete;
+		TaskLocal& operator=(const TaskLocal&) = delete;
+	public: // without a task argument they use the running task
+		// nullptr while the task has none
+		T* get() const { return get(impl::CurrentTask()); }
+		T* get(ITask* task) const
+		{
+			return (task != nullptr) ? (T*)static_cast<impl::IXTask*>(task)->LocalSlot(m_index) : nullptr;
+		}
+		void set(T value) { set(impl::CurrentTask(), std::move(value)); }
+		void set(ITask* task, T value)
+		{
+			assert(task != nullptr);
+			void*& slot = static_cast<impl::IXTask*>(task)->LocalSlot(m_index);
+
+			if (slot != nullptr)
+			{
+				*(T*)slot = std::move(value);
+			}
+			else
+			{
+				slot = new T(std::move(value));
+			}
+		}
+		void reset() { reset(impl::CurrentTask()); }
+		void reset(ITask* task)
+		{
+			void*& slot = static_cast<impl::IXTask*>(task)->LocalSlot(m_index);
+
+			if (slot != nullptr)
+			{
+				Destroy(slot);
+				slot = nullptr;
+			}
+		}
+	protected:
+		static void Destroy(void* value) { delete (T*)value; }
+		static void* Copy(const void* value) { return new T(*(const T*)value); }
+	private:
+		int m_index;
+	};
 }
 
@@ -0,0 +1,664 @@
+#pragma once
+#include <mutex>
+#include "libco.hpp"
+#include "libco_sync.hpp"
+
+// bounded channels passing values between tasks
+//
+//   libco::Channel<int> chan(64);          // tasks of one scheduler
+//   chan.send(task, 42);                   // suspends while full
+//   int value;
+//   while (chan.recv(task, &value)) { }    // suspends while empty, false once closed and drained
+//   chan.close();
+//
+// capacity 0 makes an unbuffered channel, send waits until a receiver takes
+// the value. SharedChannel has the same api for tasks of different schedulers
+// (threads), values go through a lock-free ring and only a task that has to
+// wait takes a lock. Select waits on several channels, sockets and a
+// timeout at once.
+namespace libco
+{
+	class Select;
+
+	template<typename T> class Channel
+	{
+		friend class Select;
+	protected:
+		enum { closed, delivered };
+	public:
+		explicit Channel(std::size_t capacity) : m_buffer(capacity), m_head(0), m_count(0), m_closed(false) { }
+		Channel(const Channel&) = delete;
+		Channel& operator=(const Channel&) = delete;
+	public:
+		// false once closed, the value is dropped
+		bool send(ITask* task, T value)
+		{
+			if (m_closed)
+			{
+				return false;
+			}
+			if (TrySend(value))
+			{
+				return true;
+			}
+			// a receiver moves the value out of our stack
+			return (m_senders.Wait(task, 0, &value) == delivered);
+		}
+		// value is only moved from when it returns true
+		bool try_send(T&& value)
+		{
+			return (!m_closed && TrySend(value));
+		}
+		// false once closed and every buffered value is received
+		bool recv(ITask* task, T* value)
+		{
+			if (try_recv(value))
+			{
+				return true;
+			}
+			if (m_closed)
+			{
+				return false;
+			}
+			return (m_receivers.Wait(task, 0, value) == delivered);
+		}
+		bool try_recv(T* value)
+		{
+			if (m_count > 0)
+			{
+				*value = Pop();
+				// room again, the first sender gets its value in
+				if (!m_senders.empty())
+				{
+					Push(std::move(*(T*)m_senders.front()->data));
+					m_senders.Wake(delivered);
+				}
+				return true;
+			}
+			if (!m_senders.empty())
+			{
+				// unbuffered, straight from the sender
+				*value = std::move(*(T*)m_senders.front()->data);
+				m_senders.Wake(delivered);
+				return true;
+			}
+			return false;
+		}
+		// wakes every waiter, buffered values can still be received
+		void close()
+		{
+			if (m_closed)
+			{
+				return;
+			}
+			m_closed = true;
+			while (!m_receivers.empty())
+			{
+				m_receivers.Wake(closed);
+			}
+			while (!m_senders.empty())
+			{
+				m_senders.Wake(closed);
+			}
+		}
+		bool is_closed() const { return m_closed; }
+		std::size_t size() const { return m_count; }
+		std::size_t capacity() const { return m_buffer.size(); }
+	protected:
+		bool TrySend(T& value)
+		{
+			if (!m_receivers.empty())
+			{
+				// someone waits so the buffer is empty, hand it over
+				*(T*)m_receivers.front()->data = std::move(value);
+				m_receivers.Wake(delivered);
+				return true;
+			}
+			if (m_count < m_buffer.size())
+			{
+				Push(std::move(value));
+				return true;
+			}
+			return false;
+		}
+		void Push(T&& value)
+		{
+			m_buffer[(m_head + m_count) % m_buffer.size()] = std::move(value);
+			m_count++;
+		}
+		T Pop()
+		{
+			T value = std::move(m_buffer[m_head]);
+
+			m_buffer[m_head] = T(); // let go of what the slot holds
+			m_head = (m_head + 1) % m_buffer.size();
+			m_count--;
+			return value;
+		}
+	private:
+		std::vector<T> m_buffer;
+		std::size_t m_head;
+		std::size_t m_count;
+		bool m_closed;
+		impl::CXWaitQueue m_senders;
+		impl::CXWaitQueue m_receivers;
+	};
+
+	// waits for whichever case is ready first
+	//
+	//   libco::Select select(task);
+	//   int on_msg = select.recv(control, &msg);
+	//   int on_data = select.recv(sock, buf, sizeof(buf), &nread);
+	//   int which = select.wait(1000);        // Select::timeout after a second
+	//
+	// a case that is ready when added wins right away, otherwise the task is
+	// parked on every source at once. the first one to fire takes the others
+	// back before anything else runs, so only the winner moves a value or
+	// reads bytes. cases live in the object, waiting does not allocate, and
+	// after wait it is empty again for the next round. sockets must stay open
+	// while a case waits on them, as with recv.
+	class Select
+	{
+	public:
+		enum { max_cases = 8, timeout = -1 };
+	protected:
+		enum case_type { case_channel, case_socket };
+		struct select_case;
+		struct uv_select_read_ext : impl::uv_exclude_ext { select_case* owner; char* buf; int len; };
+		struct select_case
+		{
+			impl::sync_waiter waiter; // first member, notify finds the case from it
+			Select* select;
+			case_type type;
+			bool armed;
+			impl::CXWaitQueue* queue; // channel
+			bool* ok;
+			uv_tcp_t* handle; // socket
+			uv_select_read_ext read;
+			int* nread;
+		};
+	public:
+		explicit Select(ITask* task) : m_task(static_cast<impl::IXTask*>(task)), m_count(0), m_winner(-1), m_suspended(false), m_timer_armed(false) { }
+		~Select() { Reset(); }
+		Select(const Select&) = delete;
+		Select& operator=(const Select&) = delete;
+	public: // each returns the index of the case, -1 when there are max_cases already
+		// ok is false when the case won because the channel is closed
+		template<typename T> int recv(Channel<T>& chan, T* value, bool* ok = nullptr)
+		{
+			select_case* c = Add(case_channel);
+
+			if (c == nullptr)
+			{
+				return -1;
+			}
+			c->ok = ok;
+			if (m_winner < 0)
+			{
+				if (chan.try_recv(value))
+				{
+					Fire(c, Channel<T>::delivered);
+				}
+				else if (chan.is_closed())
+				{
+					Fire(c, Channel<T>::closed);
+				}
+				else
+				{
+					Arm(c, &chan.m_receivers, value);
+				}
+			}
+			return Index(c);
+		}
+		// value is only moved from when this case wins
+		template<typename T> int send(Channel<T>& chan, T& value, bool* ok = nullptr)
+		{
+			select_case* c = Add(case_channel);
+
+			if (c == nullptr)
+			{
+				return -1;
+			}
+			c->ok = ok;
+			if (m_winner < 0)
+			{
+				if (chan.is_closed())
+				{
+					Fire(c, Channel<T>::closed);
+				}
+				else if (chan.TrySend(value))
+				{
+					Fire(c, Channel<T>::delivered);
+				}
+				else
+				{
+					Arm(c, &chan.m_senders, &value);
+				}
+			}
+			return Index(c);
+		}
+		// nread gets what recv would have returned
+		int recv(uv_os_sock_t s, char* buf, int len, int* nread)
+		{
+			select_case* c = Add(case_socket);
+
+			if (c == nullptr)
+			{
+				return -1;
+			}
+			c->nread = nread;
+			if (m_winner < 0)
+			{
+				if (uv_tcp_t* tcp_handle = m_task->GetXOwner()->QueryTcpSocket(s))
+				{
+					impl::CXHandle Handle(tcp_handle);
+
+					c->handle = tcp_handle;
+					c->read.type = impl::uv_exclude_select;
+					c->read.owner = c;
+					c->read.buf = buf;
+					c->read.len = len;
+					// another task reading it makes the case fail like recv would
+					if (!Handle.SetExclude(&c->read))
+					{
+						Fire(c, -1);
+						return Index(c);
+					}
+					int errcode = uv_read_start(Handle, [](uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+						auto* reqx = impl::CXHandle(handle).GetExclude<uv_select_read_ext>();
+
+						assert(reqx->type == impl::uv_exclude_select);
+						buf->base = reqx->buf;
+						buf->len = reqx->len;
+					}, [](uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+						auto* reqx = impl::CXHandle(stream).GetExclude<uv_select_read_ext>();
+
+						assert(reqx->type == impl::uv_exclude_select);
+						if (nread == 0)
+						{
+							return; // EAGAIN, keep reading
+						}
+						reqx->owner->select->Fire(reqx->owner, (int)nread);
+					});
+					if (errcode == 0)
+					{
+						c->armed = true;
+					}
+					else
+					{
+						Handle.ResetExclude();
+						Fire(c, errcode);
+					}
+				}
+				else
+				{
+					Fire(c, -1);
+				}
+			}
+			return Index(c);
+		}
+	public:
+		// index of the case that won, timeout when none did within timeout_ms (-1 waits
+		// forever, 0 only looks at what is ready). without cases it sleeps
+		int wait(std::int64_t timeout_ms = -1)
+		{
+			if ((m_winner < 0) && (timeout_ms != 0) && ((m_count > 0) || (timeout_ms > 0)))
+			{
+				// the per-task timer resumes us directly, a winner stops it first
+				if (timeout_ms > 0)
+				{
+					m_timer_armed = (m_task->StartTimer(timeout_ms) == 0);
+				}
+				if ((timeout_ms < 0) || m_timer_armed)
+				{
+					m_suspended = true;
+					m_task->SuspendBlocked((m_count > 0) ? blocked_sync : blocked_timer);
+					m_suspended = false;
+				}
+			}
+			int winner = m_winner;
+
+			Reset();
+			return ((winner >= 0) ? winner : (int)timeout);
+		}
+	protected:
+		select_case* Add(case_type type)
+		{
+			if (m_count >= max_cases)
+			{
+				return nullptr;
+			}
+			select_case* c = &m_cases[m_count++];
+
+			c->select = this;
+			c->type = type;
+			c->armed = false;
+			return c;
+		}
+		int Index(select_case* c) const { return (int)(c - m_cases); }
+		void Arm(select_case* c, impl::CXWaitQueue* queue, void* data)
+		{
+			c->waiter.task = m_task;
+			c->waiter.mode = 0;
+			c->waiter.data = data;
+			c->waiter.result = 0;
+			c->waiter.notify = Notify;
+			c->queue = queue;
+			queue->Push(&c->waiter);
+			c->armed = true;
+		}
+		void Disarm(select_case* c)
+		{
+			if (!c->armed)
+			{
+				return;
+			}
+			c->armed = false;
+			if (c->type == case_channel)
+			{
+				c->queue->Remove(&c->waiter);
+			}
+			else
+			{
+				impl::CXHandle Handle(c->handle);
+
+				uv_read_stop(Handle);
+				Handle.ResetExclude();
+			}
+		}
+		// a channel popped the waiter and already moved the value
+		static void Notify(impl::sync_waiter* waiter)
+		{
+			select_case* c = reinterpret_cast<select_case*>(waiter);
+
+			c->armed = false;
+			c->select->Fire(c, waiter->result);
+		}
+		// everything else is taken back here, before the loop runs anything
+		void Fire(select_case* c, int result)
+		{
+			if (m_winner >= 0)
+			{
+				return;
+			}
+			m_winner = Index(c);
+			if (c->type == case_channel)
+			{
+				if (c->ok != nullptr)
+				{
+					*c->ok = (result != 0);
+				}
+			}
+			else if (c->nread != nullptr)
+			{
+				*c->nread = result;
+			}
+			for (int i = 0; i < m_count; i++)
+			{
+				Disarm(&m_cases[i]);
+			}
+			if (m_timer_armed)
+			{
+				m_task->StopTimer();
+				m_timer_armed = false;
+			}
+			// fired while the cases are still being added, wait returns at once
+			if (m_suspended)
+			{
+				m_task->GetXOwner()->WakeupTask(m_task);
+			}
+		}
+		void Reset()
+		{
+			for (int i = 0; i < m_count; i++)
+			{
+				Disarm(&m_cases[i]);
+			}
+			if (m_timer_armed)
+			{
+				m_task->StopTimer();
+				m_timer_armed = false;
+			}
+			m_count = 0;
+			m_winner = -1;
+		}
+	private:
+		impl::IXTask* m_task;
+		select_case m_cases[max_cases];
+		int m_count;
+		int m_winner;
+		bool m_suspended;
+		bool m_timer_armed;
+	};
+
+	// any number of senders and receivers on any schedulers. the ring is the
+	// bounded mpmc queue with a sequence number per cell, the two counters
+	// sit on their own cache lines. a blocked task parks on its own scheduler,
+	// wakeups from other threads are batched into one loop iteration there
+	template<typename T> class SharedChannel
+	{
+	protected:
+		enum { cache_line = 64 };
+		struct cell
+		{
+			std::atomic<std::size_t> sequence;
+			T value;
+		};
+	public:
+		// capacity is rounded up to a power of two
+		explicit SharedChannel(std::size_t capacity) : m_mask(RoundUp(capacity) - 1), m_closed(false),
+			m_senders_waiting(0), m_receivers_waiting(0), m_enqueue(0), m_dequeue(0)
+		{
+			m_cells = new cell[m_mask + 1];
+			for (std::size_t i = 0; i <= m_mask; i++)
+			{
+				m_cells[i].sequence.store(i, std::memory_order_relaxed);
+			}
+		}
+		~SharedChannel() { delete[] m_cells; }
+		SharedChannel(const SharedChannel&) = delete;
+		SharedChannel& operator=(const SharedChannel&) = delete;
+	public:
+		// false once closed, the value is dropped
+		bool send(ITask* task, T value)
+		{
+			while (!m_closed.load(std::memory_order_acquire))
+			{
+				if (TryPush(value))
+				{
+					Notify(m_receivers, m_receivers_waiting);
+					return true;
+				}
+				Park(static_cast<impl::IXTask*>(task), m_senders, m_senders_waiting, false);
+			}
+			return false;
+		}
+		// value is only moved from when it returns true
+		bool try_send(T&& value)
+		{
+			if (!m_closed.load(std::memory_order_acquire) && TryPush(value))
+			{
+				Notify(m_receivers, m_receivers_waiting);
+				return true;
+			}
+			return false;
+		}
+		// false once closed and every buffered value is received
+		bool recv(ITask* task, T* value)
+		{
+			while (true)
+			{
+				if (try_recv(value))
+				{
+					return true;
+				}
+				if (m_closed.load(std::memory_order_acquire))
+				{
+					// a send may have finished right before the close
+					return try_recv(value);
+				}
+				Park(static_cast<impl::IXTask*>(task), m_receivers, m_receivers_waiting, true);
+			}
+		}
+		bool try_recv(T* value)
+		{
+			if (TryPop(value))
+			{
+				Notify(m_senders, m_senders_waiting);
+				return true;
+			}
+			return false;
+		}
+		void close()
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+
+			m_closed.store(true);
+			WakeAll(m_senders, m_senders_waiting);
+			WakeAll(m_receivers, m_receivers_waiting);
+		}
+		bool is_closed() const { return m_closed.load(std::memory_order_acquire); }
+		// only a snapshot while other threads use it
+		std::size_t size() const
+		{
+			return m_enqueue.load(std::memory_order_relaxed) - m_dequeue.load(std::memory_order_relaxed);
+		}
+		std::size_t capacity() const { return m_mask + 1; }
+	protected:
+		static std::size_t RoundUp(std::size_t capacity)
+		{
+			std::size_t size = 2; // one cell can not tell full from empty
+
+			while (size < capacity)
+			{
+				size <<= 1;
+			}
+			return size;
+		}
+		bool TryPush(T& value)
+		{
+			std::size_t pos = m_enqueue.load(std::memory_order_relaxed);
+
+			while (true)
+			{
+				cell* c = &m_cells[pos & m_mask];
+				std::intptr_t diff = (std::intptr_t)c->sequence.load(std::memory_order_acquire) - (std::intptr_t)pos;
+
+				if (diff == 0)
+				{
+					if (m_enqueue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					{
+						c->value = std::move(value);
+						c->sequence.store(pos + 1, std::memory_order_release);
+						return true;
+					}
+				}
+				else if (diff < 0)
+				{
+					return false; // full
+				}
+				else
+				{
+					pos = m_enqueue.load(std::memory_order_relaxed);
+				}
+			}
+		}
+		bool TryPop(T* value)
+		{
+			std::size_t pos = m_dequeue.load(std::memory_order_relaxed);
+
+			while (true)
+			{
+				cell* c = &m_cells[pos & m_mask];
+				std::intptr_t diff = (std::intptr_t)c->sequence.load(std::memory_order_acquire) - (std::intptr_t)(pos + 1);
+
+				if (diff == 0)
+				{
+					if (m_dequeue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					{
+						*value = std::move(c->value);
+						c->value = T();
+						c->sequence.store(pos + m_mask + 1, std::memory_order_release);
+						return true;
+					}
+				}
+				else if (diff < 0)
+				{
+					return false; // empty
+				}
+				else
+				{
+					pos = m_dequeue.load(std::memory_order_relaxed);
+				}
+			}
+		}
+		// may say yes when another thread just took the cell, callers retry
+		bool Ready(bool for_recv)
+		{
+			std::size_t pos = for_recv ? m_dequeue.load(std::memory_order_relaxed) : m_enqueue.load(std::memory_order_relaxed);
+			std::size_t sequence = m_cells[pos & m_mask].sequence.load(std::memory_order_acquire);
+
+			return ((std::intptr_t)(sequence - (for_recv ? pos + 1 : pos)) >= 0);
+		}
+		// announce the waiter first and look at the ring again, a push or pop
+		// in between sees the count and wakes us
+		void Park(impl::IXTask* task, impl::CXWaitQueue& queue, std::atomic<int>& waiting, bool for_recv)
+		{
+			impl::sync_waiter waiter = { task, nullptr, 0, nullptr, 0, nullptr };
+			{
+				std::lock_guard<std::mutex> lock(m_lock);
+
+				queue.Push(&waiter);
+				waiting.fetch_add(1);
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				if (Ready(for_recv) || m_closed.load())
+				{
+					queue.Remove(&waiter);
+					waiting.fetch_sub(1);
+					return;
+				}
+			}
+			task->GetXOwner()->SuspendRemote(task, blocked_sync);
+		}
+		void Notify(impl::CXWaitQueue& queue, std::atomic<int>& waiting)
+		{
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (waiting.load(std::memory_order_relaxed) > 0)
+			{
+				std::lock_guard<std::mutex> lock(m_lock);
+
+				if (impl::sync_waiter* waiter = queue.Pop())
+				{
+					waiting.fetch_sub(1);
+					// the node dies once the task runs, do not touch it afterwards
+					waiter->task->GetXOwner()->WakeupRemote(waiter->task);
+				}
+			}
+		}
+		void WakeAll(impl::CXWaitQueue& queue, std::atomic<int>& waiting)
+		{
+			while (impl::sync_waiter* waiter = queue.Pop())
+			{
+				waiting.fetch_sub(1);
+				waiter->task->GetXOwner()->WakeupRemote(waiter->task);
+			}
+		}
+	private:
+		std::size_t m_mask;
+		cell* m_cells;
+		std::atomic<bool> m_closed;
+
+		std::mutex m_lock;
+		impl::CXWaitQueue m_senders;
+		impl::CXWaitQueue m_receivers;
+		std::atomic<int> m_senders_waiting;
+		std::atomic<int> m_receivers_waiting;
+
+		// producers and consumers each write their own line only
+		char m_pad0[cache_line];
+		std::atomic<std::size_t> m_enqueue;
+		char m_pad1[cache_line - sizeof(std::atomic<std::size_t>)];
+		std::atomic<std::size_t> m_dequeue;
+		char m_pad2[cache_line - sizeof(std::atomic<std::size_t>)];
+	};
+}
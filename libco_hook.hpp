@@ -0,0 +1,291 @@
+#pragma once
+#include "libco.hpp"
+
+// opt-in, blocking winsock calls made from inside a task go through ITask
+//
+//   libco::InstallHooks();               // patch the exe
+//   libco::InstallHooks(legacy_module);  // and any dll linked into handlers
+//
+// the import table of a module is patched, so only calls made by patched
+// modules are redirected; threads that are not running a task and calls with
+// flags keep the original behaviour. a tcp socket is attached to the scheduler
+// (non-blocking, on the loop's port) the first time a task hands it to a
+// hooked connect / send / recv, sockets never passed to one are left alone.
+// libco calls ws2_32 directly, see impl::RawWinsock.
+namespace libco
+{
+	namespace impl
+	{
+		class CXHook
+		{
+		protected:
+			typedef int (WSAAPI* closesocket_fn)(SOCKET s);
+			typedef int (WSAAPI* connect_fn)(SOCKET s, const struct sockaddr* name, int namelen);
+			typedef int (WSAAPI* send_fn)(SOCKET s, const char* buf, int len, int flags);
+			typedef int (WSAAPI* recv_fn)(SOCKET s, char* buf, int len, int flags);
+			typedef int (WSAAPI* poll_fn)(LPWSAPOLLFD fds, ULONG nfds, INT timeout);
+			typedef VOID(WINAPI* sleep_fn)(DWORD ms);
+
+			typedef struct
+			{
+				closesocket_fn closesocket;
+				connect_fn connect;
+				send_fn send;
+				recv_fn recv;
+				poll_fn poll;
+				sleep_fn sleep;
+			}ORIGINALS;
+
+			static ORIGINALS& Originals()
+			{
+				static ORIGINALS originals = []() {
+					ORIGINALS o;
+					HMODULE ws2 = GetModuleHandleA("ws2_32.dll");
+					HMODULE kernel = GetModuleHandleA("kernel32.dll");
+
+					assert(ws2 != nullptr);
+					o.closesocket = (closesocket_fn)GetProcAddress(ws2, "closesocket");
+					o.connect = (connect_fn)GetProcAddress(ws2, "connect");
+					o.send = (send_fn)GetProcAddress(ws2, "send");
+					o.recv = (recv_fn)GetProcAddress(ws2, "recv");
+					o.poll = (poll_fn)GetProcAddress(ws2, "WSAPoll");
+					o.sleep = (sleep_fn)GetProcAddress(kernel, "Sleep");
+					return o;
+				}();
+				return originals;
+			}
+			static IXTask* OwnedBy(SOCKET s)
+			{
+				IXTask* task = CurrentTask();
+
+				if ((task != nullptr) && (task->GetXOwner()->QueryTcpSocket(s) != nullptr))
+				{
+					return task;
+				}
+				return nullptr;
+			}
+			// attaches a tcp socket on its first hooked call from a task
+			static IXTask* Adopt(SOCKET s)
+			{
+				IXTask* task = CurrentTask();
+				WSAPROTOCOL_INFOW info;
+				int len = sizeof(info);
+
+				if (task == nullptr)
+				{
+					return nullptr;
+				}
+				if (task->GetXOwner()->QueryTcpSocket(s) != nullptr)
+				{
+					return task;
+				}
+				if ((getsockopt(s, SOL_SOCKET, SO_PROTOCOL_INFOW, (char*)&info, &len) == 0) &&
+					(info.iSocketType == SOCK_STREAM) && (info.iProtocol == IPPROTO_TCP) &&
+					task->GetXOwner()->AttachTcpSocket(s))
+				{
+					return task;
+				}
+				return nullptr;
+			}
+			static int Fail(int errcode)
+			{
+				int wsa_error;
+
+				switch (errcode)
+				{
+				case UV_ECONNREFUSED: wsa_error = WSAECONNREFUSED; break;
+				case UV_ECONNABORTED: wsa_error = WSAECONNABORTED; break;
+				case UV_ETIMEDOUT: wsa_error = WSAETIMEDOUT; break;
+				case UV_ENOTCONN: wsa_error = WSAENOTCONN; break;
+				case UV_EADDRINUSE: wsa_error = WSAEADDRINUSE; break;
+				case UV_ENETUNREACH: wsa_error = WSAENETUNREACH; break;
+				case UV_EHOSTUNREACH: wsa_error = WSAEHOSTUNREACH; break;
+				case UV_ECANCELED: wsa_error = WSAEINTR; break;
+				default: wsa_error = WSAECONNRESET; break;
+				}
+				WSASetLastError(wsa_error);
+				return SOCKET_ERROR;
+			}
+		protected: // hooks
+			static int WSAAPI _closesocket(SOCKET s)
+			{
+				if (IXTask* task = CurrentTask())
+				{
+					task->wait_release(s);
+					if (OwnedBy(s) != nullptr)
+					{
+						task->closesocket(s);
+						return 0;
+					}
+				}
+				return Originals().closesocket(s);
+			}
+			static int WSAAPI _connect(SOCKET s, const struct sockaddr* name, int namelen)
+			{
+				if (IXTask* task = Adopt(s))
+				{
+					int status = task->connect(s, name, namelen);
+
+					return (status == 0) ? 0 : Fail(status);
+				}
+				return Originals().connect(s, name, namelen);
+			}
+			static int WSAAPI _send(SOCKET s, const char* buf, int len, int flags)
+			{
+				IXTask* task = (flags == 0) ? Adopt(s) : nullptr;
+
+				if (task != nullptr)
+				{
+					int status = task->send(s, buf, len);
+
+					return (status == 0) ? len : Fail(status);
+				}
+				return Originals().send(s, buf, len, flags);
+			}
+			static int WSAAPI _recv(SOCKET s, char* buf, int len, int flags)
+			{
+				IXTask* task = (flags == 0) ? Adopt(s) : nullptr;
+
+				if (task != nullptr)
+				{
+					int nread = task->recv(s, buf, len);
+
+					if (nread >= 0)
+					{
+						return nread;
+					}
+					return (nread == UV_EOF) ? 0 : Fail(nread);
+				}
+				return Originals().recv(s, buf, len, flags);
+			}
+			static int WSAAPI _WSAPoll(LPWSAPOLLFD fds, ULONG nfds, INT timeout)
+			{
+				IXTask* task = CurrentTask();
+
+				if (task == nullptr)
+				{
+					return Originals().poll(fds, nfds, timeout);
+				}
+
+				std::uint64_t start = uv_hrtime();
+				while (true)
+				{
+					int ready = Originals().poll(fds, nfds, 0);
+					std::int64_t remain = -1;
+
+					if (ready != 0)
+					{
+						return ready;
+					}
+					if (timeout >= 0)
+					{
+						remain = timeout - (std::int64_t)((uv_hrtime() - start) / 1000000);
+						if (remain <= 0)
+						{
+							return 0;
+						}
+					}
+
+					// one socket and one direction parks on the loop, anything
+					// else is rechecked every millisecond
+					SHORT rd = POLLRDNORM | POLLRDBAND, wr = POLLWRNORM;
+					int result = -1;
+					if ((nfds == 1) && !((fds[0].events & rd) && (fds[0].events & wr)))
+					{
+						if (fds[0].events & rd)
+						{
+							result = task->wait_readable(fds[0].fd, remain);
+						}
+						else
+						{
+							result = task->wait_writable(fds[0].fd, remain);
+						}
+					}
+					if (result == UV_ECANCELED)
+					{
+						return Fail(result);
+					}
+					// another task waits on the socket or it can not be polled, a failed
+					// wait returns at once and would spin without giving the loop back
+					if ((result < 0) && !task->Sleep(1))
+					{
+						return Fail(UV_ECANCELED);
+					}
+				}
+			}
+			static VOID WINAPI _Sleep(DWORD ms)
+			{
+				if (IXTask* task = CurrentTask())
+				{
+					task->Sleep(ms);
+				}
+				else
+				{
+					Originals().sleep(ms);
+				}
+			}
+		protected:
+			static int PatchThunk(HMODULE module, void* from, void* to)
+			{
+				int patched = 0;
+				auto* base = (BYTE*)module;
+				auto* dos = (PIMAGE_DOS_HEADER)base;
+				auto* nt = (PIMAGE_NT_HEADERS)(base + dos->e_lfanew);
+				auto& dir = nt->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT];
+
+				if ((from == nullptr) || (dir.VirtualAddress == 0))
+				{
+					return 0;
+				}
+				// match on the resolved address, so imports by ordinal and
+				// through forwarders are found as well
+				for (auto* desc = (PIMAGE_IMPORT_DESCRIPTOR)(base + dir.VirtualAddress); desc->Name != 0; desc++)
+				{
+					for (auto* thunk = (PIMAGE_THUNK_DATA)(base + desc->FirstThunk); thunk->u1.Function != 0; thunk++)
+					{
+						if ((void*)thunk->u1.Function == from)
+						{
+							DWORD protect;
+
+							if (VirtualProtect(&thunk->u1.Function, sizeof(thunk->u1.Function), PAGE_READWRITE, &protect))
+							{
+								thunk->u1.Function = (ULONG_PTR)to;
+								VirtualProtect(&thunk->u1.Function, sizeof(thunk->u1.Function), protect, &protect);
+								patched++;
+							}
+						}
+					}
+				}
+				return patched;
+			}
+		public:
+			static int Patch(HMODULE module, bool install)
+			{
+				int patched = 0;
+				ORIGINALS& o = Originals();
+				const struct { void* original; void* hook; } table[] = {
+					{ (void*)o.closesocket, (void*)_closesocket },
+					{ (void*)o.connect, (void*)_connect },
+					{ (void*)o.send, (void*)_send },
+					{ (void*)o.recv, (void*)_recv },
+					{ (void*)o.poll, (void*)_WSAPoll },
+					{ (void*)o.sleep, (void*)_Sleep },
+				};
+
+				if (module == nullptr)
+				{
+					module = GetModuleHandle(nullptr);
+				}
+				for (auto& entry : table)
+				{
+					patched += install ? PatchThunk(module, entry.original, entry.hook) : PatchThunk(module, entry.hook, entry.original);
+				}
+				return patched;
+			}
+		};
+	} // namespace impl
+
+	// returns how many import slots were redirected, module nullptr is the exe
+	inline int InstallHooks(HMODULE module = nullptr) { return impl::CXHook::Patch(module, true); }
+	inline int UninstallHooks(HMODULE module = nullptr) { return impl::CXHook::Patch(module, false); }
+}
@@ -0,0 +1,563 @@
+#pragma once
+#include "libco.hpp"
+
+// http/1.1 server on ITask, one task per connection
+//
+//   libco::ServeHttp(task, listener, [](libco::ITask* task, const libco::HttpRequest& req, libco::HttpResponse& res) {
+//       res.send(200, "hello", 5, "text/plain");
+//   });
+//
+// requests are parsed in place in the connection buffer, every view in
+// HttpRequest is valid until the handler returns. keep-alive follows the
+// request version and Connection header, pipelined requests are answered
+// in order and responses that are ready together leave in one send.
+namespace libco
+{
+	struct HttpString
+	{
+		const char* data;
+		int len;
+
+		// ascii case-insensitive
+		bool equals(const char* s) const
+		{
+			for (int i = 0; i < len; i++, s++)
+			{
+				if ((*s == '\0') || (Lower(data[i]) != Lower(*s)))
+				{
+					return false;
+				}
+			}
+			return (*s == '\0');
+		}
+		static char Lower(char c) { return ((c >= 'A') && (c <= 'Z')) ? (char)(c + ('a' - 'A')) : c; }
+	};
+
+	struct HttpHeader
+	{
+		HttpString name;
+		HttpString value;
+	};
+
+	class HttpRequest
+	{
+	public:
+		enum { max_headers = 32 };
+
+		HttpString method;
+		HttpString target;
+		int minor_version; // HTTP/1.x
+		HttpHeader headers[max_headers];
+		int header_count;
+		HttpString body;
+		bool keep_alive;
+	public:
+		// first header with that name, nullptr if missing
+		const HttpString* header(const char* name) const
+		{
+			for (int i = 0; i < header_count; i++)
+			{
+				if (headers[i].name.equals(name))
+				{
+					return &headers[i].value;
+				}
+			}
+			return nullptr;
+		}
+	};
+
+	namespace impl
+	{
+		class CXHttpConnection;
+	}
+
+	// one response per request, send or begin_chunked ... end_chunked
+	class HttpResponse
+	{
+		friend class impl::CXHttpConnection;
+	protected:
+		enum state_type { state_none, state_chunked, state_done };
+		enum { copy_limit = 4 * 1024 }; // smaller bodies are copied behind the head
+
+		HttpResponse(ITask* task, uv_os_sock_t s, std::string& out)
+			: m_task(task), m_sock(s), m_out(out), m_state(state_none), m_keep_alive(true), m_keep_alive_capable(true), m_head_only(false), m_chunked(false)
+		{
+
+		}
+	public:
+		// before send / begin_chunked, name and value are copied
+		void add_header(const char* name, const char* value)
+		{
+			m_headers.append(name).append(": ").append(value).append("\r\n");
+		}
+		int send(int status, const char* body, int len, const char* content_type = nullptr)
+		{
+			if (m_state != state_none)
+			{
+				return -1;
+			}
+			m_state = state_done;
+			WriteHead(status, content_type, len);
+			if (m_head_only || (len == 0))
+			{
+				return 0;
+			}
+			if (len <= copy_limit)
+			{
+				m_out.append(body, len);
+				return 0;
+			}
+
+			uv_buf_t bufs[2];
+			bufs[0] = uv_buf_init(&m_out[0], (unsigned int)m_out.size());
+			bufs[1] = uv_buf_init((char*)body, (unsigned int)len);
+
+			int status_code = m_task->send(m_sock, bufs, 2);
+			m_out.clear();
+			return status_code;
+		}
+		// HTTP/1.0 peers get the raw data and the connection is closed after it
+		int begin_chunked(int status, const char* content_type = nullptr)
+		{
+			if (m_state != state_none)
+			{
+				return -1;
+			}
+			m_state = state_chunked;
+			m_chunked = !m_head_only && m_keep_alive_capable;
+			if (!m_chunked)
+			{
+				m_keep_alive = m_keep_alive && m_head_only;
+			}
+			WriteHead(status, content_type, -1);
+			return 0;
+		}
+		// every chunk goes out right away, head and size line in the same send
+		int write_chunk(const char* data, int len)
+		{
+			if (m_state != state_chunked)
+			{
+				return -1;
+			}
+			if (m_head_only || (len == 0))
+			{
+				return 0;
+			}
+
+			uv_buf_t bufs[3];
+			unsigned int nbufs = 0;
+
+			if (m_chunked)
+			{
+				AppendNumber(m_out, (unsigned int)len, 16);
+				m_out.append("\r\n");
+			}
+			if (!m_out.empty())
+			{
+				bufs[nbufs++] = uv_buf_init(&m_out[0], (unsigned int)m_out.size());
+			}
+			bufs[nbufs++] = uv_buf_init((char*)data, (unsigned int)len);
+			if (m_chunked)
+			{
+				bufs[nbufs++] = uv_buf_init((char*)"\r\n", 2);
+			}
+
+			int status = m_task->send(m_sock, bufs, nbufs);
+			m_out.clear();
+			return status;
+		}
+		int end_chunked()
+		{
+			if (m_state != state_chunked)
+			{
+				return -1;
+			}
+			m_state = state_done;
+			if (m_chunked)
+			{
+				m_out.append("0\r\n\r\n");
+			}
+			return 0;
+		}
+	protected:
+		static void AppendNumber(std::string& out, std::uint64_t value, int base)
+		{
+			char digits[24];
+			int n = 0;
+
+			do
+			{
+				digits[n++] = "0123456789abcdef"[value % base];
+				value /= base;
+			} while (value != 0);
+			while (n > 0)
+			{
+				out.push_back(digits[--n]);
+			}
+		}
+		static const char* StatusText(int status)
+		{
+			switch (status)
+			{
+			case 100: return "Continue";
+			case 200: return "OK";
+			case 201: return "Created";
+			case 204: return "No Content";
+			case 206: return "Partial Content";
+			case 301: return "Moved Permanently";
+			case 302: return "Found";
+			case 304: return "Not Modified";
+			case 400: return "Bad Request";
+			case 401: return "Unauthorized";
+			case 403: return "Forbidden";
+			case 404: return "Not Found";
+			case 405: return "Method Not Allowed";
+			case 408: return "Request Timeout";
+			case 413: return "Payload Too Large";
+			case 429: return "Too Many Requests";
+			case 431: return "Request Header Fields Too Large";
+			case 500: return "Internal Server Error";
+			case 501: return "Not Implemented";
+			case 502: return "Bad Gateway";
+			case 503: return "Service Unavailable";
+			case 505: return "HTTP Version Not Supported";
+			default: return "Unknown";
+			}
+		}
+		// length -1 is a chunked / close delimited body
+		void WriteHead(int status, const char* content_type, int length)
+		{
+			m_out.append("HTTP/1.1 ");
+			AppendNumber(m_out, status, 10);
+			m_out.append(" ").append(StatusText(status)).append("\r\n");
+			if (length >= 0)
+			{
+				m_out.append("Content-Length: ");
+				AppendNumber(m_out, length, 10);
+				m_out.append("\r\n");
+			}
+			else if (m_chunked)
+			{
+				m_out.append("Transfer-Encoding: chunked\r\n");
+			}
+			if (content_type != nullptr)
+			{
+				m_out.append("Content-Type: ").append(content_type).append("\r\n");
+			}
+			if (!m_keep_alive)
+			{
+				m_out.append("Connection: close\r\n");
+			}
+			m_out.append(m_headers).append("\r\n");
+		}
+	private:
+		ITask* m_task;
+		uv_os_sock_t m_sock;
+		std::string& m_out; // pending output of the connection
+		std::string m_headers;
+		state_type m_state;
+		bool m_keep_alive;
+		bool m_keep_alive_capable; // HTTP/1.1 peer
+		bool m_head_only;
+		bool m_chunked;
+	};
+
+	typedef std::function<void(ITask*, const HttpRequest&, HttpResponse&)> HttpHandler;
+
+	namespace impl
+	{
+		class CXHttpConnection
+		{
+		public:
+			enum { buffer_size = 16 * 1024, max_body = 8 * 1024 * 1024, flush_limit = 64 * 1024, linger_limit = 256 * 1024 };
+
+			CXHttpConnection(ITask* task, uv_os_sock_t s) : m_task(task), m_sock(s), m_reader(task, s, buffer_size), m_consume(0)
+			{
+				m_out.reserve(flush_limit);
+			}
+		public:
+			int Run(const HttpHandler& handler)
+			{
+				int status = 0;
+				bool keep_alive = true;
+
+				while (keep_alive)
+				{
+					HttpRequest request;
+					const char* head = nullptr;
+					int head_len = m_reader.peek_until("\r\n\r\n", 4, &head);
+
+					if (head_len < 0)
+					{
+						// peer closed between requests is the normal end
+						status = (head_len == UV_EOF) ? 0 : head_len;
+						if (head_len == UV_ENOBUFS)
+						{
+							Reject(431);
+						}
+						break;
+					}
+
+					int error = Parse(head, head_len, request);
+					if (error != 0)
+					{
+						Reject(error);
+						break;
+					}
+
+					HttpResponse response(m_task, m_sock, m_out);
+					response.m_keep_alive = keep_alive = request.keep_alive;
+					response.m_keep_alive_capable = (request.minor_version >= 1);
+					response.m_head_only = request.method.equals("HEAD");
+
+					handler(m_task, request, response);
+					if (response.m_state == HttpResponse::state_none)
+					{
+						response.send(500, nullptr, 0);
+					}
+					else if (response.m_state == HttpResponse::state_chunked)
+					{
+						response.end_chunked();
+					}
+					keep_alive = response.m_keep_alive;
+					if (m_consume > 0)
+					{
+						m_reader.consume(m_consume);
+					}
+
+					// pipelined requests already buffered are answered first,
+					// their responses go out together
+					if (!keep_alive || (m_reader.buffered() == 0) || (m_out.size() >= flush_limit))
+					{
+						if ((status = Flush()) != 0)
+						{
+							break;
+						}
+					}
+				}
+				Flush();
+				return status;
+			}
+		protected:
+			int Flush()
+			{
+				int status = 0;
+
+				if (!m_out.empty())
+				{
+					status = m_task->send(m_sock, m_out.data(), (int)m_out.size());
+					m_out.clear();
+				}
+				return status;
+			}
+			// the peer may still be sending, closing on unread data would reset
+			// the connection before it sees the error, so drain for a while
+			void Reject(int status)
+			{
+				HttpResponse response(m_task, m_sock, m_out);
+				char discard[4096];
+				int drained = 0;
+
+				response.m_keep_alive = false;
+				response.send(status, nullptr, 0);
+				if ((Flush() == 0) && (m_task->shutdown(m_sock) == 0))
+				{
+					while (drained < linger_limit)
+					{
+						int nread = m_task->recv(m_sock, discard, sizeof(discard));
+
+						if (nread <= 0)
+						{
+							break;
+						}
+						drained += nread;
+					}
+				}
+			}
+			static bool IsToken(char c)
+			{
+				return (c > 0x20) && (c < 0x7f) && (c != ':');
+			}
+			// 0 or the status to reject the request with, the body is read as well
+			int Parse(const char* head, int head_len, HttpRequest& request)
+			{
+				const char* p = head;
+				const char* end = head + head_len - 2; // last empty line
+				const char* eol = FindByte(p, end, '\r');
+
+				// method SP target SP HTTP/1.x
+				const char* sp1 = FindByte(p, eol, ' ');
+				const char* sp2 = (sp1 != nullptr) ? FindByte(sp1 + 1, eol, ' ') : nullptr;
+				if ((sp2 == nullptr) || (sp1 == p) || (sp2 == sp1 + 1) || (eol - sp2 != 9) || (memcmp(sp2 + 1, "HTTP/", 5) != 0) || (sp2[7] != '.'))
+				{
+					return 400;
+				}
+				if ((sp2[6] != '1') || ((sp2[8] != '0') && (sp2[8] != '1')))
+				{
+					return 505;
+				}
+				request.method = { p, (int)(sp1 - p) };
+				request.target = { sp1 + 1, (int)(sp2 - sp1 - 1) };
+				request.minor_version = sp2[8] - '0';
+				request.header_count = 0;
+				request.body = { nullptr, 0 };
+
+				bool has_close = false, has_keep_alive = false;
+				std::uint64_t content_length = 0;
+
+				for (p = eol + 2; p < end; p = eol + 2)
+				{
+					eol = FindByte(p, end, '\r');
+					if ((eol == nullptr) || (eol[1] != '\n'))
+					{
+						return 400;
+					}
+
+					const char* colon = p;
+					while ((colon < eol) && IsToken(*colon))
+					{
+						colon++;
+					}
+					if ((colon == p) || (colon == eol) || (*colon != ':'))
+					{
+						return 400; // also obsolete line folding
+					}
+					if (request.header_count == HttpRequest::max_headers)
+					{
+						return 431;
+					}
+
+					const char* value = colon + 1;
+					const char* value_end = eol;
+					while ((value < value_end) && ((*value == ' ') || (*value == '\t')))
+					{
+						value++;
+					}
+					while ((value_end > value) && ((value_end[-1] == ' ') || (value_end[-1] == '\t')))
+					{
+						value_end--;
+					}
+
+					HttpHeader& header = request.headers[request.header_count++];
+					header.name = { p, (int)(colon - p) };
+					header.value = { value, (int)(value_end - value) };
+
+					if (header.name.equals("Content-Length"))
+					{
+						if (header.value.len == 0)
+						{
+							return 400;
+						}
+						content_length = 0;
+						for (int i = 0; i < header.value.len; i++)
+						{
+							char c = header.value.data[i];
+
+							if ((c < '0') || (c > '9') || (content_length > max_body))
+							{
+								return (content_length > max_body) ? 413 : 400;
+							}
+							content_length = content_length * 10 + (c - '0');
+						}
+					}
+					else if (header.name.equals("Transfer-Encoding"))
+					{
+						return 501; // chunked request bodies are not supported
+					}
+					else if (header.name.equals("Connection"))
+					{
+						has_close = has_close || header.value.equals("close");
+						has_keep_alive = has_keep_alive || header.value.equals("keep-alive");
+					}
+				}
+				if (content_length > max_body)
+				{
+					return 413;
+				}
+				request.keep_alive = (request.minor_version >= 1) ? !has_close : has_keep_alive;
+				return ReadBody(head, head_len, (int)content_length, request);
+			}
+			// the body lands behind the head in the reader when both fit,
+			// otherwise the head is copied out and the body read into m_body
+			int ReadBody(const char* head, int head_len, int length, HttpRequest& request)
+			{
+				const char* base = head;
+
+				m_consume = head_len + length;
+				if (m_consume <= m_reader.capacity())
+				{
+					if ((length > 0) && (m_reader.peek(m_consume, &base) < 0))
+					{
+						return 400;
+					}
+					request.body = { base + head_len, length };
+				}
+				else
+				{
+					m_head.assign(head, head_len);
+					base = m_head.data();
+					m_reader.consume(head_len);
+					m_body.resize(length);
+					if (m_reader.read_exact(&m_body[0], length) < 0)
+					{
+						return 400;
+					}
+					request.body = { m_body.data(), length };
+					m_consume = 0;
+				}
+				if (base != head)
+				{
+					Rebase(request.method, head, base);
+					Rebase(request.target, head, base);
+					for (int i = 0; i < request.header_count; i++)
+					{
+						Rebase(request.headers[i].name, head, base);
+						Rebase(request.headers[i].value, head, base);
+					}
+				}
+				return 0;
+			}
+			static void Rebase(HttpString& str, const char* from, const char* to)
+			{
+				str.data = to + (str.data - from);
+			}
+		private:
+			ITask* m_task;
+			uv_os_sock_t m_sock;
+			StreamReader m_reader;
+			std::string m_out;
+			std::string m_head;
+			std::string m_body;
+			int m_consume;
+		};
+	} // namespace impl
+
+	// serves one accepted socket until the peer or the handler ends it, the socket is closed
+	inline int ServeHttpConnection(ITask* task, uv_os_sock_t s, const HttpHandler& handler)
+	{
+		int status;
+		{
+			impl::CXHttpConnection connection(task, s);
+			status = connection.Run(handler);
+		}
+		task->closesocket(s);
+		return status;
+	}
+
+	// accept loop on a listening socket, a new task for every connection
+	inline void ServeHttp(ITask* task, uv_os_sock_t listener, HttpHandler handler)
+	{
+		while (true)
+		{
+			uv_os_sock_t s = task->accept(listener, nullptr, nullptr);
+
+			if (s == (uv_os_sock_t)invalid_socket)
+			{
+				break;
+			}
+			task->GetOwner()->NewTask([s, handler](ITask* task) {
+				ServeHttpConnection(task, s, handler);
+			});
+		}
+	}
+}
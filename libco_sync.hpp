@@ -0,0 +1,319 @@
+#pragma once
+#include "libco.hpp"
+
+// locks between tasks of one scheduler, not between threads
+//
+//   libco::Mutex mutex;
+//   mutex.lock(task);     // suspends only this task while another one holds it
+//   ...                   // may send / recv / Sleep while holding it
+//   mutex.unlock();
+//
+// waiters queue up in order and a release hands the lock straight to the
+// first one, nobody can barge in between. the waiter lives on the stack of
+// the waiting task and is woken through the ready queue, so waiting does
+// not allocate. release may be called from any task or from the scheduler.
+namespace libco
+{
+	namespace impl
+	{
+		struct sync_waiter
+		{
+			IXTask* task;
+			sync_waiter* next;
+			int mode; // what the waiter wants, meaning is up to the primitive
+			void* data; // value passed between waker and waiter
+			int result; // set by the waker
+			void (*notify)(sync_waiter* waiter); // called instead of waking the task, see Select
+		};
+
+		class CXWaitQueue
+		{
+		public:
+			CXWaitQueue() : m_head(nullptr), m_tail(nullptr) { }
+			CXWaitQueue(const CXWaitQueue&) = delete;
+			CXWaitQueue& operator=(const CXWaitQueue&) = delete;
+		public:
+			bool empty() const { return (m_head == nullptr); }
+			sync_waiter* front() const { return m_head; }
+			// suspends the task until Wake pops it, returns what Wake was given
+			int Wait(ITask* task, int mode = 0, void* data = nullptr)
+			{
+				IXTask* xtask = static_cast<IXTask*>(task);
+				sync_waiter waiter = { xtask, nullptr, mode, data, 0, nullptr };
+
+				Push(&waiter);
+				xtask->SuspendBlocked(blocked_sync);
+				return waiter.result;
+			}
+			void Wake(int result = 0)
+			{
+				sync_waiter* waiter = Pop();
+
+				assert(waiter != nullptr);
+				waiter->result = result;
+				if (waiter->notify != nullptr)
+				{
+					waiter->notify(waiter);
+					return;
+				}
+				// the node dies once the task runs, do not touch it afterwards
+				waiter->task->GetXOwner()->WakeupTask(waiter->task);
+			}
+		public: // raw list, for waiters that do not suspend right away
+			void Push(sync_waiter* waiter)
+			{
+				waiter->next = nullptr;
+				if (m_tail != nullptr)
+				{
+					m_tail->next = waiter;
+				}
+				else
+				{
+					m_head = waiter;
+				}
+				m_tail = waiter;
+			}
+			sync_waiter* Pop()
+			{
+				sync_waiter* waiter = m_head;
+
+				if ((waiter != nullptr) && ((m_head = waiter->next) == nullptr))
+				{
+					m_tail = nullptr;
+				}
+				return waiter;
+			}
+			void Remove(sync_waiter* waiter)
+			{
+				sync_waiter* prev = nullptr;
+
+				for (sync_waiter* node = m_head; node != nullptr; prev = node, node = node->next)
+				{
+					if (node == waiter)
+					{
+						if (prev != nullptr)
+						{
+							prev->next = node->next;
+						}
+						else
+						{
+							m_head = node->next;
+						}
+						if (m_tail == node)
+						{
+							m_tail = prev;
+						}
+						break;
+					}
+				}
+			}
+		private:
+			sync_waiter* m_head;
+			sync_waiter* m_tail;
+		};
+	} // namespace impl
+
+	class Mutex
+	{
+	public:
+		Mutex() : m_locked(false) { }
+	public:
+		void lock(ITask* task)
+		{
+			if (!m_locked)
+			{
+				m_locked = true;
+				return;
+			}
+			// unlock leaves it locked for us
+			m_waiters.Wait(task);
+		}
+		bool try_lock()
+		{
+			if (m_locked)
+			{
+				return false;
+			}
+			m_locked = true;
+			return true;
+		}
+		void unlock()
+		{
+			assert(m_locked);
+			if (!m_waiters.empty())
+			{
+				m_waiters.Wake();
+			}
+			else
+			{
+				m_locked = false;
+			}
+		}
+	private:
+		bool m_locked;
+		impl::CXWaitQueue m_waiters;
+	};
+
+	// a waiting writer holds back later readers, neither side starves
+	class RWLock
+	{
+	protected:
+		enum { want_read, want_write };
+	public:
+		RWLock() : m_readers(0), m_writer(false) { }
+	public:
+		void lock_shared(ITask* task)
+		{
+			if (!m_writer && m_waiters.empty())
+			{
+				m_readers++;
+				return;
+			}
+			m_waiters.Wait(task, want_read);
+		}
+		bool try_lock_shared()
+		{
+			if (!m_writer && m_waiters.empty())
+			{
+				m_readers++;
+				return true;
+			}
+			return false;
+		}
+		void unlock_shared()
+		{
+			assert(m_readers > 0);
+			if (--m_readers == 0)
+			{
+				Grant();
+			}
+		}
+		void lock(ITask* task)
+		{
+			if (!m_writer && (m_readers == 0) && m_waiters.empty())
+			{
+				m_writer = true;
+				return;
+			}
+			m_waiters.Wait(task, want_write);
+		}
+		bool try_lock()
+		{
+			if (!m_writer && (m_readers == 0) && m_waiters.empty())
+			{
+				m_writer = true;
+				return true;
+			}
+			return false;
+		}
+		void unlock()
+		{
+			assert(m_writer);
+			m_writer = false;
+			Grant();
+		}
+	protected:
+		// one writer, or every reader up to the next writer
+		void Grant()
+		{
+			while (!m_waiters.empty() && !m_writer)
+			{
+				if (m_waiters.front()->mode == want_write)
+				{
+					if (m_readers == 0)
+					{
+						m_writer = true;
+						m_waiters.Wake();
+					}
+					break;
+				}
+				m_readers++;
+				m_waiters.Wake();
+			}
+		}
+	private:
+		int m_readers;
+		bool m_writer;
+		impl::CXWaitQueue m_waiters;
+	};
+
+	class CondVar
+	{
+	public:
+		// mutex is released while waiting and held again on return,
+		// recheck the condition, a notify only means it may have changed
+		void wait(ITask* task, Mutex& mutex)
+		{
+			mutex.unlock();
+			m_waiters.Wait(task);
+			mutex.lock(task);
+		}
+		template<typename _Pred> void wait(ITask* task, Mutex& mutex, _Pred pred)
+		{
+			while (!pred())
+			{
+				wait(task, mutex);
+			}
+		}
+		void notify_one()
+		{
+			if (!m_waiters.empty())
+			{
+				m_waiters.Wake();
+			}
+		}
+		void notify_all()
+		{
+			while (!m_waiters.empty())
+			{
+				m_waiters.Wake();
+			}
+		}
+	private:
+		impl::CXWaitQueue m_waiters;
+	};
+
+	class Semaphore
+	{
+	public:
+		explicit Semaphore(int count = 0) : m_count(count) { }
+	public:
+		void acquire(ITask* task)
+		{
+			if ((m_count > 0) && m_waiters.empty())
+			{
+				m_count--;
+				return;
+			}
+			// release passes its unit to us without counting it
+			m_waiters.Wait(task);
+		}
+		bool try_acquire()
+		{
+			if ((m_count > 0) && m_waiters.empty())
+			{
+				m_count--;
+				return true;
+			}
+			return false;
+		}
+		void release(int n = 1)
+		{
+			for (; n > 0; n--)
+			{
+				if (!m_waiters.empty())
+				{
+					m_waiters.Wake();
+				}
+				else
+				{
+					m_count++;
+				}
+			}
+		}
+		int count() const { return m_count; }
+	private:
+		int m_count;
+		impl::CXWaitQueue m_waiters;
+	};
+}
@@ -0,0 +1,265 @@
+#pragma once
+#include "libco.hpp"
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+// tls over ITask::send/recv, OpenSSL runs on memory BIOs so it never
+// touches the socket. link libssl and libcrypto.
+//
+//   auto* ctx = libco::CreateTlsServer("cert.pem", "key.pem"); // one per scheduler
+//   auto* tls = ctx->NewStream(sock);
+//   tls->handshake(task);
+//   tls->recv(task, buf, len);
+//   tls->Delete();
+namespace libco
+{
+	class ITlsStream
+	{
+	public:
+		virtual void Delete() = 0;
+	public: // same return convention as ITask
+		virtual int handshake(ITask* task) = 0;
+		virtual int send(ITask* task, const char* buf, int len) = 0;
+		virtual int recv(ITask* task, char* buf, int len) = 0;
+		virtual int shutdown(ITask* task) = 0;
+	};
+
+	class ITlsContext
+	{
+	public:
+		virtual void Delete() = 0;
+	public:
+		// server_name is the SNI / verified host of a client stream, ignored on server
+		virtual ITlsStream* NewStream(uv_os_sock_t s, const char* server_name = nullptr) = 0;
+	};
+
+	namespace impl
+	{
+		class CXOpenSSLStream : public ITlsStream
+		{
+		protected:
+			enum { read_chunk = 32 * 1024 }; // a few records per recv
+
+			CXOpenSSLStream(SSL* ssl, uv_os_sock_t s) : m_ssl(ssl), m_sock(s)
+			{
+				m_rbio = BIO_new(BIO_s_mem());
+				m_wbio = BIO_new(BIO_s_mem());
+				SSL_set_bio(m_ssl, m_rbio, m_wbio);
+			}
+			virtual ~CXOpenSSLStream()
+			{
+				SSL_free(m_ssl); // frees both BIOs
+			}
+		public:
+			static ITlsStream* Create(SSL* ssl, uv_os_sock_t s)
+			{
+				return new CXOpenSSLStream(ssl, s);
+			}
+			virtual void Delete() override { delete this; }
+		protected:
+			// everything the engine produced so far leaves in one send,
+			// a full handshake flight or many records are not split up
+			int Flush(ITask* task)
+			{
+				char* data = nullptr;
+				long pending = BIO_get_mem_data(m_wbio, &data);
+
+				if (pending > 0)
+				{
+					int status = task->send(m_sock, data, (int)pending);
+
+					(void)BIO_reset(m_wbio);
+					return status;
+				}
+				return 0;
+			}
+			int Fill(ITask* task)
+			{
+				int nread = task->recv(m_sock, m_buffer, read_chunk);
+
+				if (nread > 0)
+				{
+					BIO_write(m_rbio, m_buffer, nread);
+				}
+				return nread;
+			}
+			template<typename _Fn> int Pump(ITask* task, _Fn op)
+			{
+				while (true)
+				{
+					int ret = op();
+					int error = (ret > 0) ? SSL_ERROR_NONE : SSL_get_error(m_ssl, ret);
+					int status = Flush(task);
+
+					if (status != 0)
+					{
+						return status;
+					}
+					switch (error)
+					{
+					case SSL_ERROR_NONE:
+						return ret;
+					case SSL_ERROR_WANT_READ:
+						status = Fill(task);
+						if (status <= 0)
+						{
+							return (status == 0) ? UV_EOF : status;
+						}
+						break;
+					case SSL_ERROR_WANT_WRITE:
+						break; // memory bio, already flushed
+					case SSL_ERROR_ZERO_RETURN:
+						return UV_EOF;
+					default:
+						ERR_clear_error();
+						return UV_EPROTO;
+					}
+				}
+			}
+		public:
+			virtual int handshake(ITask* task) override
+			{
+				int ret = Pump(task, [this]() { return SSL_do_handshake(m_ssl); });
+
+				return (ret > 0) ? 0 : ret;
+			}
+			virtual int send(ITask* task, const char* buf, int len) override
+			{
+				int ret = Pump(task, [this, buf, len]() { return SSL_write(m_ssl, buf, len); });
+
+				return (ret > 0) ? 0 : ret;
+			}
+			virtual int recv(ITask* task, char* buf, int len) override
+			{
+				return Pump(task, [this, buf, len]() { return SSL_read(m_ssl, buf, len); });
+			}
+			virtual int shutdown(ITask* task) override
+			{
+				SSL_shutdown(m_ssl);
+				return Flush(task);
+			}
+		private:
+			SSL* m_ssl;
+			BIO* m_rbio;
+			BIO* m_wbio;
+			uv_os_sock_t m_sock;
+			char m_buffer[read_chunk];
+		};
+
+		// not thread safe, give every scheduler its own context
+		class CXOpenSSLContext : public ITlsContext
+		{
+		protected:
+			CXOpenSSLContext(SSL_CTX* ctx, bool server) : m_ctx(ctx), m_server(server)
+			{
+				SSL_CTX_set_ex_data(m_ctx, ContextIndex(), this);
+				if (m_server)
+				{
+					static const unsigned char sid_ctx[] = "libco";
+
+					SSL_CTX_set_session_cache_mode(m_ctx, SSL_SESS_CACHE_SERVER);
+					SSL_CTX_set_session_id_context(m_ctx, sid_ctx, sizeof(sid_ctx) - 1);
+				}
+				else
+				{
+					// sessions are kept by server name and offered on the next stream
+					SSL_CTX_set_session_cache_mode(m_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+					SSL_CTX_sess_set_new_cb(m_ctx, [](SSL* ssl, SSL_SESSION* session) -> int {
+						auto* self = (CXOpenSSLContext*)SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), ContextIndex());
+						const char* name = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+
+						if (name == nullptr)
+						{
+							return 0;
+						}
+						SSL_SESSION*& cached = self->m_sessions[name];
+						if (cached != nullptr)
+						{
+							SSL_SESSION_free(cached);
+						}
+						cached = session;
+						return 1; // we keep the reference
+					});
+				}
+			}
+			virtual ~CXOpenSSLContext()
+			{
+				for (auto& cached : m_sessions)
+				{
+					SSL_SESSION_free(cached.second);
+				}
+				SSL_CTX_free(m_ctx);
+			}
+			static int ContextIndex()
+			{
+				static int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+				return index;
+			}
+		public:
+			static ITlsContext* CreateServer(const char* cert_file, const char* key_file)
+			{
+				if (SSL_CTX* ctx = SSL_CTX_new(TLS_server_method()))
+				{
+					if ((SSL_CTX_use_certificate_chain_file(ctx, cert_file) == 1) &&
+						(SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) == 1))
+					{
+						return new CXOpenSSLContext(ctx, true);
+					}
+					SSL_CTX_free(ctx);
+				}
+				return nullptr;
+			}
+			static ITlsContext* CreateClient(bool verify_peer)
+			{
+				if (SSL_CTX* ctx = SSL_CTX_new(TLS_client_method()))
+				{
+					if (verify_peer)
+					{
+						SSL_CTX_set_default_verify_paths(ctx);
+						SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, nullptr);
+					}
+					return new CXOpenSSLContext(ctx, false);
+				}
+				return nullptr;
+			}
+			virtual void Delete() override { delete this; }
+		public:
+			virtual ITlsStream* NewStream(uv_os_sock_t s, const char* server_name) override
+			{
+				SSL* ssl = SSL_new(m_ctx);
+
+				if (ssl == nullptr)
+				{
+					return nullptr;
+				}
+				if (m_server)
+				{
+					SSL_set_accept_state(ssl);
+				}
+				else
+				{
+					if (server_name != nullptr)
+					{
+						SSL_set_tlsext_host_name(ssl, server_name);
+						SSL_set1_host(ssl, server_name);
+
+						auto cached = m_sessions.find(server_name);
+						if (cached != m_sessions.end())
+						{
+							SSL_set_session(ssl, cached->second);
+						}
+					}
+					SSL_set_connect_state(ssl);
+				}
+				return CXOpenSSLStream::Create(ssl, s);
+			}
+		private:
+			SSL_CTX* m_ctx;
+			bool m_server;
+			std::unordered_map<std::string, SSL_SESSION*> m_sessions;
+		};
+	} // namespace impl
+
+	inline ITlsContext* CreateTlsServer(const char* cert_file, const char* key_file) { return impl::CXOpenSSLContext::CreateServer(cert_file, key_file); }
+	inline ITlsContext* CreateTlsClient(bool verify_peer = true) { return impl::CXOpenSSLContext::CreateClient(verify_peer); }
+}
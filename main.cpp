@@ -3,6 +3,9 @@
 #include "libuv/uv.h"
 #pragma comment(lib, "libuv.lib")
 #include "libco.hpp"
+#include "libco_http.hpp"
+#include "libco_sync.hpp"
+#include "libco_channel.hpp"
 #include <thread>
 #pragma comment(lib, "ws2_32.lib")
 
@@ -62,19 +65,33 @@ void tcp_server(libco::ITask* task)
 	int err;
 	SOCKET server;
 	sockaddr_in dest;
+	int destlen = sizeof(dest);
 
 	server = task->socket(AF_INET);
-	err = uv_ip4_addr("127.0.0.1", 6666, &dest);
-	err = task->bind(server, (sockaddr*)&dest, sizeof(dest));
+	err = task->resolve("localhost", 6666, (sockaddr*)&dest, &destlen, AF_INET);
+	err = task->bind(server, (sockaddr*)&dest, destlen);
+
+	// small echo replies should not wait for Nagle, accepted sockets get the
+	// listener's options, past 50000 open clients the rest waits in the backlog
+	libco::SocketOptions options = {};
+	options.nodelay = 1;
+	options.max_connections = 50000;
+	err = task->setsockopt(server, options);
 	err = task->listen(server, 100000);
 
+	// responders belong to the server, leaving the loop waits for them
+	libco::TaskGroup clients;
+
 	while (true)
 	{
 		SOCKET cli = task->accept(server, nullptr, nullptr);
 
 		if (cli != INVALID_SOCKET)
 		{
-			task->GetOwner()->NewTask(std::bind(tcp_server_responder, std::placeholders::_1, cli));
+			clients.spawn([cli](libco::ITask* task) {
+				tcp_server_responder(task, cli);
+				return 0;
+			});
 		}
 		else
 		{
@@ -82,12 +99,450 @@ void tcp_server(libco::ITask* task)
 		}
 	}
 	task->closesocket(server);
+	clients.wait();
+}
+
+// echo round trips over many connections, one task per client
+void bench_echo_server(libco::ITask* task, int connections)
+{
+	SOCKET server;
+	sockaddr_in dest;
+
+	server = task->socket(AF_INET);
+	uv_ip4_addr("127.0.0.1", 6667, &dest);
+	task->bind(server, (sockaddr*)&dest, sizeof(dest));
+	task->listen(server, connections);
+
+	for (int i = 0; i < connections; i++)
+	{
+		SOCKET cli = task->accept(server, nullptr, nullptr);
+
+		if (cli == INVALID_SOCKET)
+		{
+			break;
+		}
+		task->GetOwner()->NewTask(std::bind(tcp_server_responder, std::placeholders::_1, cli));
+	}
+	task->closesocket(server);
+}
+
+void bench_echo(int connections, int rounds)
+{
+	auto* scheduler = libco::CreateScheduler();
+	int finished = 0;
+	std::uint64_t start = uv_hrtime();
+
+	scheduler->NewTask(std::bind(bench_echo_server, std::placeholders::_1, connections));
+	for (int i = 0; i < connections; i++)
+	{
+		scheduler->NewTask([&](libco::ITask* task) {
+			char buf[64] = { 0 };
+			sockaddr_in dest;
+			SOCKET sock = task->socket(AF_INET);
+
+			uv_ip4_addr("127.0.0.1", 6667, &dest);
+			if (task->connect(sock, (sockaddr*)&dest, sizeof(dest)) == 0)
+			{
+				for (int n = 0; n < rounds; n++)
+				{
+					int got = 0;
+
+					if (task->send(sock, buf, sizeof(buf)) != 0)
+					{
+						break;
+					}
+					while (got < (int)sizeof(buf))
+					{
+						int k = task->recv(sock, buf + got, (int)sizeof(buf) - got);
+
+						if (k <= 0)
+						{
+							break;
+						}
+						got += k;
+					}
+					if (got < (int)sizeof(buf))
+					{
+						break;
+					}
+				}
+			}
+			task->closesocket(sock);
+
+			if (++finished == connections)
+			{
+				double secs = (uv_hrtime() - start) / 1e9;
+
+				printf("%d connections, %d round trips each: %.3fs, %.0f rtt/s\n",
+					connections, rounds, secs, connections * (double)rounds / secs);
+				printf("%s", task->GetOwner()->DumpTiming().c_str());
+			}
+		});
+	}
+
+	scheduler->Peek();
+	scheduler->Delete();
+}
+
+// wrk style, keep-alive connections each sending pipeline requests per round trip
+void bench_http_server(libco::ITask* task, int connections)
+{
+	SOCKET server;
+	sockaddr_in dest;
+
+	server = task->socket(AF_INET);
+	uv_ip4_addr("127.0.0.1", 8080, &dest);
+	task->bind(server, (sockaddr*)&dest, sizeof(dest));
+	task->listen(server, connections);
+
+	for (int i = 0; i < connections; i++)
+	{
+		SOCKET cli = task->accept(server, nullptr, nullptr);
+
+		if (cli == INVALID_SOCKET)
+		{
+			break;
+		}
+		task->GetOwner()->NewTask([cli](libco::ITask* task) {
+			libco::ServeHttpConnection(task, cli, [](libco::ITask* task, const libco::HttpRequest& req, libco::HttpResponse& res) {
+				res.send(200, "hello, world", 12, "text/plain");
+			});
+		});
+	}
+	task->closesocket(server);
+}
+
+void bench_http(int connections, int requests, int pipeline)
+{
+	auto* scheduler = libco::CreateScheduler();
+	int finished = 0;
+	std::uint64_t bytes = 0;
+	std::uint64_t start = uv_hrtime();
+
+	scheduler->NewTask(std::bind(bench_http_server, std::placeholders::_1, connections));
+	for (int i = 0; i < connections; i++)
+	{
+		scheduler->NewTask([&](libco::ITask* task) {
+			static const char request[] = "GET /plaintext HTTP/1.1\r\nHost: localhost\r\n\r\n";
+			std::string batch;
+			sockaddr_in dest;
+			SOCKET sock = task->socket(AF_INET);
+
+			for (int n = 0; n < pipeline; n++)
+			{
+				batch.append(request, sizeof(request) - 1);
+			}
+			uv_ip4_addr("127.0.0.1", 8080, &dest);
+			if (task->connect(sock, (sockaddr*)&dest, sizeof(dest)) == 0)
+			{
+				libco::StreamReader reader(task, sock);
+
+				for (int sent = 0; sent < requests; sent += pipeline)
+				{
+					if (task->send(sock, batch.data(), (int)batch.size()) != 0)
+					{
+						break;
+					}
+
+					int n = 0;
+					for (; n < pipeline; n++)
+					{
+						const char* head;
+						const char* body;
+						int head_len = reader.read_until("\r\n\r\n", 4, &head);
+
+						if (head_len <= 0)
+						{
+							break;
+						}
+						// the server always sends Content-Length
+						int body_len = 0;
+						for (const char* p = head; p + 16 < head + head_len; p++)
+						{
+							if (memcmp(p, "Content-Length: ", 16) == 0)
+							{
+								body_len = atoi(p + 16);
+								break;
+							}
+						}
+						if ((body_len > 0) && (reader.peek(body_len, &body) < 0))
+						{
+							break;
+						}
+						reader.consume(body_len);
+						bytes += head_len + body_len;
+					}
+					if (n < pipeline)
+					{
+						break;
+					}
+				}
+			}
+			task->closesocket(sock);
+
+			if (++finished == connections)
+			{
+				double secs = (uv_hrtime() - start) / 1e9;
+				double total = connections * (double)requests;
+
+				printf("%d connections, pipeline %d: %.0f requests in %.3fs\n", connections, pipeline, total, secs);
+				printf("Requests/sec: %.0f\nTransfer/sec: %.2fMB\n", total / secs, bytes / secs / (1024 * 1024));
+			}
+		});
+	}
+
+	scheduler->Peek();
+	scheduler->Delete();
+}
+
+// source -> proxy -> sink, the sink answers with the byte count after eof,
+// which comes back over the half-closed relay
+void bench_relay(std::uint64_t total)
+{
+	auto* scheduler = libco::CreateScheduler();
+	std::uint64_t start = uv_hrtime();
+
+	// sink
+	scheduler->NewTask([](libco::ITask* task) {
+		static char buf[64 * 1024];
+		sockaddr_in dest;
+		SOCKET server = task->socket(AF_INET);
+		std::uint64_t received = 0;
+
+		uv_ip4_addr("127.0.0.1", 6669, &dest);
+		task->bind(server, (sockaddr*)&dest, sizeof(dest));
+		task->listen(server, 1);
+
+		SOCKET cli = task->accept(server, nullptr, nullptr);
+		while (true)
+		{
+			int n = task->recv(cli, buf, sizeof(buf));
+
+			if (n <= 0)
+			{
+				break;
+			}
+			received += n;
+		}
+		task->send(cli, (const char*)&received, sizeof(received));
+		task->closesocket(cli);
+		task->closesocket(server);
+	});
+	// proxy
+	scheduler->NewTask([](libco::ITask* task) {
+		sockaddr_in dest;
+		SOCKET server = task->socket(AF_INET);
+
+		uv_ip4_addr("127.0.0.1", 6668, &dest);
+		task->bind(server, (sockaddr*)&dest, sizeof(dest));
+		task->listen(server, 1);
+
+		SOCKET front = task->accept(server, nullptr, nullptr);
+		SOCKET back = task->socket(AF_INET);
+
+		uv_ip4_addr("127.0.0.1", 6669, &dest);
+		if (task->connect(back, (sockaddr*)&dest, sizeof(dest)) == 0)
+		{
+			int status = task->relay(front, back);
+
+			if (status != 0)
+			{
+				printf("relay error %d\n", status);
+			}
+		}
+		task->closesocket(back);
+		task->closesocket(front);
+		task->closesocket(server);
+	});
+	// source
+	scheduler->NewTask([=](libco::ITask* task) {
+		static char buf[64 * 1024];
+		sockaddr_in dest;
+		SOCKET sock = task->socket(AF_INET);
+		std::uint64_t sent = 0, received = 0;
+
+		uv_ip4_addr("127.0.0.1", 6668, &dest);
+		if (task->connect(sock, (sockaddr*)&dest, sizeof(dest)) == 0)
+		{
+			while (sent < total)
+			{
+				int n = (total - sent < sizeof(buf)) ? (int)(total - sent) : (int)sizeof(buf);
+
+				if (task->send(sock, buf, n) != 0)
+				{
+					break;
+				}
+				sent += n;
+			}
+			task->shutdown(sock);
+			task->recv(sock, (char*)&received, sizeof(received));
+		}
+		task->closesocket(sock);
+
+		double secs = (uv_hrtime() - start) / 1e9;
+		printf("relayed %llu of %llu bytes: %.3fs, %.2f GB/s\n",
+			(unsigned long long)received, (unsigned long long)total, secs, received / secs / (1024 * 1024 * 1024));
+	});
+
+	scheduler->Peek();
+	scheduler->Delete();
+}
+
+// semaphore ping-pong between pairs of tasks, then many tasks on one mutex
+// whose holder now and then sleeps inside the critical section
+void bench_sync(int tasks, int rounds)
+{
+	// tasks play in pairs
+	tasks = (tasks < 2) ? 2 : tasks & ~1;
+
+	auto* scheduler = libco::CreateScheduler();
+	int finished = 0;
+	std::uint64_t start = uv_hrtime();
+	std::vector<libco::Semaphore> sems(tasks);
+
+	for (int i = 0; i < tasks; i++)
+	{
+		scheduler->NewTask([&, i](libco::ITask* task) {
+			libco::Semaphore& mine = sems[i];
+			libco::Semaphore& peer = sems[i ^ 1];
+
+			for (int n = 0; n < rounds; n++)
+			{
+				if (i & 1)
+				{
+					mine.acquire(task);
+					peer.release();
+				}
+				else
+				{
+					peer.release();
+					mine.acquire(task);
+				}
+			}
+			if (++finished == tasks)
+			{
+				double secs = (uv_hrtime() - start) / 1e9;
+
+				printf("semaphore ping-pong, %d tasks: %.0f handoffs/s\n", tasks, tasks * (double)rounds / secs);
+			}
+		});
+	}
+	while (finished < tasks)
+	{
+		scheduler->Peek();
+	}
+
+	libco::Mutex mutex;
+	std::uint64_t counter = 0;
+
+	finished = 0;
+	start = uv_hrtime();
+	for (int i = 0; i < tasks; i++)
+	{
+		scheduler->NewTask([&](libco::ITask* task) {
+			for (int n = 0; n < rounds; n++)
+			{
+				mutex.lock(task);
+				counter++;
+				if ((n & 15) == 0)
+				{
+					task->Yield();
+				}
+				mutex.unlock();
+			}
+			if (++finished == tasks)
+			{
+				double secs = (uv_hrtime() - start) / 1e9;
+
+				printf("mutex, %d tasks: %llu locks, %.0f locks/s\n", tasks, (unsigned long long)counter, counter / secs);
+			}
+		});
+	}
+
+	scheduler->Peek();
+	scheduler->Delete();
+}
+
+void bench_channel(int messages)
+{
+	auto* scheduler = libco::CreateScheduler();
+	libco::Channel<int> local(1024);
+	std::uint64_t start = uv_hrtime();
+
+	scheduler->NewTask([&](libco::ITask* task) {
+		for (int i = 0; i < messages; i++)
+		{
+			local.send(task, i);
+		}
+		local.close();
+	});
+	scheduler->NewTask([&](libco::ITask* task) {
+		int value, received = 0;
+
+		while (local.recv(task, &value))
+		{
+			received++;
+		}
+		printf("channel, one scheduler: %.0f msgs/s\n", received / ((uv_hrtime() - start) / 1e9));
+	});
+	scheduler->Peek();
+	scheduler->Delete();
+
+	// every producer and consumer has its own scheduler thread
+	auto shared = [messages](const char* name, int producers, int consumers) {
+		libco::SharedChannel<int> chan(1024);
+		std::atomic<int> producing(producers);
+		std::atomic<std::uint64_t> received(0);
+		std::vector<std::thread> threads;
+		std::uint64_t start = uv_hrtime();
+
+		for (int n = 0; n < producers + consumers; n++)
+		{
+			threads.emplace_back([&, n]() {
+				auto* scheduler = libco::CreateScheduler();
+
+				scheduler->NewTask([&, n](libco::ITask* task) {
+					if (n < producers)
+					{
+						for (int i = 0; i < messages / producers; i++)
+						{
+							chan.send(task, i);
+						}
+						if (--producing == 0)
+						{
+							chan.close();
+						}
+						return;
+					}
+					int value;
+					std::uint64_t count = 0;
+
+					while (chan.recv(task, &value))
+					{
+						count++;
+					}
+					received += count;
+				});
+				scheduler->Peek();
+				scheduler->Delete();
+			});
+		}
+		for (auto& thread : threads)
+		{
+			thread.join();
+		}
+		printf("shared channel, %s: %llu msgs, %.0f msgs/s\n", name, (unsigned long long)received.load(), received / ((uv_hrtime() - start) / 1e9));
+	};
+	shared("spsc", 1, 1);
+	shared("mpmc 4x4", 4, 4);
 }
 
 int main()
 {
 	auto* scheduler = libco::CreateScheduler();
 
+	// stop accepting while the loop is 100ms behind or above 1GB
+	scheduler->SetOverloadLimit(100, 1024 * 1024 * 1024);
 	scheduler->NewTask(tcp_server);
 
 	scheduler->Peek();